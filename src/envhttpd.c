@@ -1,36 +1,292 @@
+#define _GNU_SOURCE
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <getopt.h>
 #include <fnmatch.h>
 #include <ctype.h>
 #include <signal.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
 #include "template.h"
 #include "icon.h"
+#include "routes.h"
+
+#ifdef ENVHTTPD_PROFILE
+// Hot-path profiler, built in with make PROFILE=1 and switched on with -P.
+// Durations are kept in ticks of the TSC where there is one, and are only
+// converted to time when /debug/profile is read.
+#include <stdarg.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define prof_ticks() __rdtsc()
+#else
+static inline unsigned long long prof_ticks(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+typedef enum {
+  PHASE_ACCEPT,
+  PHASE_RECV,
+  PHASE_PARSE,            // request line
+  PHASE_ROUTE,            // percent-decoding, query string and route lookup
+  PHASE_LIMIT,
+  PHASE_RENDER,           // bulk bodies, on a cache miss
+  PHASE_ESCAPE,           // each escape_* call, also counted within render
+  PHASE_SEND,
+  PHASE_REQUEST,          // all of handle_client
+  PHASE_COUNT
+} ProfPhase;
+
+static const char *phase_names[PHASE_COUNT] = {
+  "accept", "recv", "parse", "route", "limit", "render", "escape", "send", "request"
+};
+
+// Log-linear buckets with 4 significant bits, as in HDR histograms: any
+// value lands within 6.25% of its true size in a fixed 8 KB per histogram
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+  unsigned long long count;
+  unsigned long long sum;
+  unsigned long long max;
+  unsigned long long buckets[HIST_BUCKETS];
+} Histogram;
+
+#define TRACE_EVENTS 128  // per request, the rest are dropped
+#define TRACE_KEEP 16     // most recent sampled requests
+
+typedef struct {
+  unsigned char phase;
+  unsigned long long start;
+  unsigned long long end;
+} TraceEvent;
+
+typedef struct {
+  unsigned long seq;
+  int route;
+  int status;
+  unsigned long allocs;
+  unsigned long alloc_bytes;
+  int events;
+  TraceEvent event[TRACE_EVENTS];
+} Trace;
+
+int profiling = 0;
+int profile_trace_every = 0;  // sample one request in N for tracing, 0 for none
+unsigned long long prof_epoch_ticks;
+long long prof_epoch_ns;
+Histogram prof_phases[PHASE_COUNT];
+Histogram prof_allocs;        // allocations per request
+Histogram prof_alloc_bytes;   // bytes allocated per request
+unsigned long prof_requests;
+unsigned long prof_timed;     // stretches of request work timed, for sampling
+unsigned long prof_total_allocs;
+unsigned long prof_total_alloc_bytes;
+unsigned long prof_request_allocs;
+unsigned long prof_request_alloc_bytes;
+unsigned long long prof_request_start;
+TraceEvent prof_accept;       // accept comes before a request is sampled
+int prof_sampled;
+Trace prof_current;
+Trace prof_traces[TRACE_KEEP];
+unsigned long prof_trace_count;
+
+static inline void prof_count_alloc(size_t size) {
+  prof_request_allocs++;
+  prof_request_alloc_bytes += size;
+  prof_total_allocs++;
+  prof_total_alloc_bytes += size;
+}
+
+static void *prof_malloc(size_t size) {
+  prof_count_alloc(size);
+  return malloc(size);
+}
+
+static void *prof_calloc(size_t n, size_t size) {
+  prof_count_alloc(n * size);
+  return calloc(n, size);
+}
+
+static void *prof_realloc(void *ptr, size_t size) {
+  prof_count_alloc(size);
+  return realloc(ptr, size);
+}
+
+static char *prof_strdup(const char *s) {
+  prof_count_alloc(strlen(s) + 1);
+  return strdup(s);
+}
+
+__attribute__((format(printf, 2, 3)))
+static int prof_asprintf(char **strp, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int rc = vasprintf(strp, fmt, ap);
+  va_end(ap);
+  if (rc >= 0) { prof_count_alloc(rc + 1); }
+  return rc;
+}
+
+// Everything below allocates through the counters
+#undef strdup
+#define malloc(size) prof_malloc(size)
+#define calloc(n, size) prof_calloc(n, size)
+#define realloc(ptr, size) prof_realloc(ptr, size)
+#define strdup(s) prof_strdup(s)
+#define asprintf(...) prof_asprintf(__VA_ARGS__)
+
+static void hist_record(Histogram *h, unsigned long long v) {
+  int b = v < HIST_SUB ? (int)v : 0;
+  if (v >= HIST_SUB) {
+    int e = 63 - __builtin_clzll(v);
+    b = (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+  }
+  h->buckets[b]++;
+  h->count++;
+  h->sum += v;
+  if (v > h->max) { h->max = v; }
+}
+
+// Highest value recorded in the bucket holding quantile q
+static unsigned long long hist_quantile(const Histogram *h, double q) {
+  unsigned long long rank = (unsigned long long)(q * h->count + 0.5), seen = 0;
+  if (rank == 0) { rank = 1; }
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen < rank) { continue; }
+    if (b < HIST_SUB) { return b; }
+    int e = b / HIST_SUB + HIST_SUB_BITS - 1;
+    unsigned long long low = (unsigned long long)(HIST_SUB + b % HIST_SUB) << (e - HIST_SUB_BITS);
+    unsigned long long high = low + (1ULL << (e - HIST_SUB_BITS)) - 1;
+    return high < h->max ? high : h->max;
+  }
+  return h->max;
+}
+
+static inline unsigned long long prof_start(void) {
+  return profiling ? prof_ticks() : 0;
+}
+
+static void prof_end(ProfPhase phase, unsigned long long start) {
+  if (!start) { return; }
+  unsigned long long end = prof_ticks();
+  hist_record(&prof_phases[phase], end - start);
+  TraceEvent event = { phase, start, end };
+  if (phase == PHASE_ACCEPT) {
+    prof_accept = event;
+  } else if (prof_sampled && prof_current.events < TRACE_EVENTS) {
+    prof_current.event[prof_current.events++] = event;
+  }
+}
+
+// Work on a request is timed from begin_request() or resume_request() until
+// it ends or is parked, so a long-poll is timed twice: once up to being
+// parked and once when answered. A connection parked before any request
+// has been read is timed from when it arrives.
+static void prof_request_begin(int resumed) {
+  if (!profiling) { return; }
+  prof_timed++;
+  prof_request_allocs = 0;
+  prof_request_alloc_bytes = 0;
+  prof_request_start = prof_ticks();
+  prof_sampled = profile_trace_every > 0 && prof_timed % profile_trace_every == 0;
+  if (prof_sampled) {
+    prof_current.seq = prof_timed;
+    prof_current.events = 0;
+    if (prof_accept.end && !resumed) { prof_current.event[prof_current.events++] = prof_accept; }
+  }
+}
+
+static void prof_request_cancel(void) {
+  prof_request_start = 0;
+  prof_sampled = 0;
+}
+
+static void prof_request_end(int route, int status, int finished) {
+  if (!profiling || !prof_request_start) { return; }
+  if (finished) { prof_requests++; }
+  prof_end(PHASE_REQUEST, prof_request_start);
+  prof_request_start = 0;
+  hist_record(&prof_allocs, prof_request_allocs);
+  hist_record(&prof_alloc_bytes, prof_request_alloc_bytes);
+  if (prof_sampled) {
+    prof_current.route = route;
+    prof_current.status = status;
+    prof_current.allocs = prof_request_allocs;
+    prof_current.alloc_bytes = prof_request_alloc_bytes;
+    prof_traces[prof_trace_count++ % TRACE_KEEP] = prof_current;
+    prof_sampled = 0;
+  }
+}
+
+#define PROF_BEGIN(phase) unsigned long long prof_start_##phase = prof_start()
+#define PROF_END(phase) prof_end(PHASE_##phase, prof_start_##phase)
+#define PROF_REQUEST_BEGIN(resumed) prof_request_begin(resumed)
+#define PROF_REQUEST_CANCEL() prof_request_cancel()
+#define PROF_REQUEST_END(finished) prof_request_end(current_request.route, current_request.status, finished)
+#else
+#define PROF_BEGIN(phase)
+#define PROF_END(phase)
+#define PROF_REQUEST_BEGIN(resumed)
+#define PROF_REQUEST_CANCEL()
+#define PROF_REQUEST_END(finished)
+#endif
 
 #define PORT 8111
 #define BUFFER_SIZE 1024
 #define MAX_METHOD_LEN 7
 #define MAX_PATH_LEN (BUFFER_SIZE - 1)
 #define MAX_VAR_NAME_LEN 256
-#define MAX_PATTERNS 100
 #define MAX_ENV_VARS 1000
 #define DEFAULT_HOSTNAME "localhost"
+#define DEFAULT_WAIT_TIMEOUT 30
+#define MAX_WAIT_TIMEOUT 300
+#define EVENTS_HEARTBEAT 15
+#define REQUEST_TIMEOUT 5 // Seconds a new connection gets to send its request
+#define ACCEPT_BATCH 64
+#define LIMIT_TABLE_SIZE 4096
+#define LIMIT_HASH_SIZE 8192
+#define ACCESS_LOG_SIZE 4096 // Records, must be a power of two
+#define ACCESS_LOG_FLUSH_MS 100
+// Environment variables used to hand state to a re-exec'd server
+#define LISTEN_FD_ENV "ENVHTTPD_LISTEN_FD"
+#define SNAPSHOT_FD_ENV "ENVHTTPD_SNAPSHOT_FD"
+#define READY_FD_ENV "ENVHTTPD_READY_FD"
+#define HANDOVER_DRAIN 10 // Seconds the old server gives in-flight responses
 
 // Configuration variables
 int server_port = PORT;
 int debug = 0;
 int daemonize = 0;
 char *hostname = DEFAULT_HOSTNAME;
+int env_source = 0;        // EnvSourceType, set with -s or -f
+const char *env_source_arg = NULL;
+int refresh_interval = 0;  // seconds between re-reads of the source, 0 for never
+int max_connections = 0;
+char *access_log_path = NULL;
+int access_log_clf = 0;
+int access_log_sample = 1;
 
 // Define a structure to hold pattern and its type
 typedef enum {
@@ -43,9 +299,50 @@ typedef struct {
   char *pattern;
 } PatternAction;
 
-// Array to store pattern actions
-PatternAction pattern_actions[MAX_PATTERNS];
+// Array to store pattern actions, in command line order
+PatternAction *pattern_actions = NULL;
 int pattern_action_count = 0;
+int pattern_action_cap = 0;
+
+// Open-addressed table of names, each with an int
+typedef struct {
+  char *name;
+  int value;
+} NameSlot;
+
+typedef struct {
+  NameSlot *slots;
+  int count;
+  int cap;                // a power of two, or 0
+} NameTable;
+
+// Prefix trie node, stored in an array with children as sibling lists
+typedef struct {
+  int child;              // first child, 0 for none
+  int sibling;
+  int last;               // last NAME* pattern ending here, -1 for none
+  unsigned char c;
+} TrieNode;
+
+// Pattern actions compiled for include_var(). Exact names go in a hash
+// table and NAME* prefixes in a trie, each remembering the index of the
+// last pattern to set it. Anything else is a glob left to fnmatch(). The
+// highest index matching a key decides, the same as applying every pattern
+// in order with the last match winning.
+NameTable literal_patterns;
+TrieNode *prefix_trie = NULL;
+int prefix_trie_count = 0;
+int prefix_trie_cap = 0;
+typedef struct {
+  int index;
+  char *needle;           // literal text any match must contain
+} GlobPattern;
+
+GlobPattern *glob_patterns = NULL;  // ascending by index
+int glob_pattern_count = 0;
+// Decisions by key, so a reload only matches keys it hasn't seen before
+#define MAX_CACHED_DECISIONS 65536
+NameTable decision_cache;
 
 // Structure to hold env vars
 typedef struct {
@@ -57,21 +354,366 @@ typedef struct {
 EnvVar env_vars[MAX_ENV_VARS];
 int env_var_count = 0;
 
+// A place to read env vars from, as raw contents and the separator between
+// entries. All sources go through the same parsing and pattern filtering.
+typedef enum {
+  SOURCE_ENV,
+  SOURCE_PROC,
+  SOURCE_FILE,
+  SOURCE_COUNT
+} EnvSourceType;
+
+typedef struct {
+  const char *name;       // as given to -s, before any :ARG
+  char *(*read)(const char *arg, size_t *len);
+  char separator;
+} EnvSource;
+
+// Hash of the source's raw contents when last parsed, so a refresh of an
+// unchanged source stops at one read and one hash
+unsigned long long env_source_hash;
+int env_source_hashed = 0;
+
+typedef struct {
+  unsigned long unchanged;
+  unsigned long parsed;
+  unsigned long failed;
+} SourceStats;
+
+SourceStats source_stats;
+
+// Snapshot version, bumped whenever a reload changes env_vars
+unsigned long env_version = 1;
+// JSON describing the most recent change, pushed to /events subscribers
+char *last_change = NULL;
+
+// Bulk endpoints which can be long-polled with ?wait=VERSION
+typedef enum {
+  BULK_NONE,
+  BULK_HTML,
+  BULK_JSON,
+  BULK_YAML,
+  BULK_SH,
+  BULK_COUNT
+} BulkFormat;
+
+// Options parsed from a request's method and query string
+#define OPT_HEAD   0x01
+#define OPT_PRETTY 0x02
+#define OPT_EXPORT 0x04
+#define OPT_WAIT   0x08
+#define OPT_TRACE  0x10
+
+typedef struct {
+  int flags;              // OPT_* bits
+  unsigned long wait;     // with OPT_WAIT, park until env_version > wait
+  long timeout;           // seconds to stay parked before answering 304
+  const char *rest;       // decoded path after a prefix route, e.g. /var/
+} RequestOptions;
+
+// Routes are looked up by a perfect hash over the first path segment. The
+// slot numbers are generated from src/routes.txt into routes.h at build time,
+// which fails on a collision; ROUTE_HASH must match the generator.
+#define ROUTE_HASH(s, len) \
+  ((((len) > 1 ? (unsigned char)(s)[1] : 0) * 5u + (unsigned char)(s)[(len) - 1] + (len)) \
+   & (ROUTE_SLOTS - 1))
+
+typedef int (*RouteHandler)(int client_socket, const RequestOptions *opts);
+
+typedef struct {
+  const char *path;
+  size_t len;
+  int prefix;             // matches only as path + "/..."
+  RouteHandler handler;   // returns 1 if it took ownership of the socket
+} Route;
+
+// Rendered bulk responses (headers + body), valid while version matches
+typedef struct {
+  unsigned long version;
+  char *response;
+  size_t header_len;
+  size_t len;
+} CachedResponse;
+
+CachedResponse response_cache[BULK_COUNT][2];
+
+// Token bucket rates in requests per second, rate 0 means unlimited
+typedef struct {
+  double rate;
+  double burst;
+} RateLimit;
+
+// Per-client default limit, index ROUTE_SLOTS, then per-route limits
+RateLimit rate_limits[ROUTE_SLOTS + 1];
+int rate_limiting = 0;
+
+// A client's buckets, kept in a fixed-size table with LRU eviction
+typedef struct {
+  in_addr_t addr;
+  int hash_next;          // next entry in the same hash chain, or -1
+  int lru_prev;           // towards most recently used, or -1
+  int lru_next;           // towards least recently used, or -1
+  long long refilled;     // now_us() of the last refill
+  float tokens[ROUTE_SLOTS + 1];
+} ClientBucket;
+
+ClientBucket *client_buckets = NULL;
+int *client_hash = NULL;
+int client_count = 0;
+int lru_head = -1;
+int lru_tail = -1;
+
+// Admission decisions, per route slot where applicable
+typedef struct {
+  unsigned long allowed[ROUTE_SLOTS];
+  unsigned long limited[ROUTE_SLOTS];
+  unsigned long shed;
+  unsigned long evicted;
+} LimiterStats;
+
+LimiterStats limiter_stats;
+
+// The request being handled, for the access log
+typedef struct {
+  in_addr_t addr;
+  int route;              // route slot, ROUTE_SLOTS until routed
+  int flags;
+  int status;
+  size_t bytes;
+  long long started;      // now_us() when handling began
+} RequestInfo;
+
+RequestInfo current_request;
+
+typedef struct {
+  long long time;         // CLOCK_REALTIME microseconds at completion
+  in_addr_t addr;
+  unsigned int latency;   // microseconds
+  unsigned int bytes;
+  unsigned short status;
+  unsigned char route;
+  unsigned char flags;
+} AccessRecord;
+
+// Single-producer single-consumer ring: the main loop appends, the log
+// thread formats and writes in batches. Records are dropped, never waited
+// for, when it is full.
+AccessRecord access_ring[ACCESS_LOG_SIZE];
+atomic_uint access_head;
+atomic_uint access_tail;
+atomic_ulong access_written;
+atomic_ulong access_dropped;
+atomic_int access_log_stopping;
+int access_log_fd = -1;
+pthread_t access_log_thread;
+
+// HTTP/2 over cleartext (h2c), by prior knowledge or Upgrade: h2c. Each
+// connection is parked as PARK_H2 and read from the main loop; its streams
+// run the same route handlers, whose HTTP/1.1 output is captured and then
+// framed. Long-polls and /events subscriptions park the stream instead.
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER 9
+#define H2_MAX_FRAME 16384          // SETTINGS_MAX_FRAME_SIZE, left at its default
+#define H2_MAX_STREAMS 100          // SETTINGS_MAX_CONCURRENT_STREAMS
+#define H2_MAX_SETTINGS 8           // in an HTTP2-Settings upgrade header
+#define H2_MAX_HEADER_BLOCK 16384
+#define H2_MAX_PENDING 262144       // per-stream bytes held back by flow control
+#define H2_IDLE_TIMEOUT 60
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_INDEXED_MAX 8            // response headers we put in the peer's table
+#define HPACK_TABLE_SIZE 4096       // SETTINGS_HEADER_TABLE_SIZE, left at its default
+#define HPACK_STATIC_COUNT 61
+
+typedef enum {
+  H2_DATA,
+  H2_HEADERS,
+  H2_PRIORITY,
+  H2_RST_STREAM,
+  H2_SETTINGS,
+  H2_PUSH_PROMISE,
+  H2_PING,
+  H2_GOAWAY,
+  H2_WINDOW_UPDATE,
+  H2_CONTINUATION
+} H2FrameType;
+
+#define H2_FLAG_END_STREAM  0x01
+#define H2_FLAG_ACK         0x01
+#define H2_FLAG_END_HEADERS 0x04
+#define H2_FLAG_PADDED      0x08
+#define H2_FLAG_PRIORITY    0x20
+
+typedef enum {
+  H2_NO_ERROR = 0x0,
+  H2_PROTOCOL_ERROR = 0x1,
+  H2_FLOW_CONTROL_ERROR = 0x3,
+  H2_FRAME_SIZE_ERROR = 0x6,
+  H2_REFUSED_STREAM = 0x7,
+  H2_COMPRESSION_ERROR = 0x9
+} H2Error;
+
+typedef struct {
+  char *name;
+  size_t name_len;
+  char *value;
+  size_t value_len;
+} HpackEntry;
+
+// A decoder's dynamic table, oldest entry first
+typedef struct {
+  HpackEntry *entries;
+  int count;
+  int cap;
+  size_t size;
+  size_t max_size;
+} HpackTable;
+
+typedef struct {
+  unsigned int id;
+  long long window;       // what the peer will accept on this stream
+  int headers_sent;
+  int end_stream;         // END_STREAM goes out once pending drains
+  int end_sent;
+  int parked;             // owned by a long-poll or /events Parked entry
+  int head;               // a HEAD request, whatever follows the headers is dropped
+  char *pending;          // DATA held back by flow control
+  size_t pending_len;
+  size_t pending_off;
+  size_t pending_cap;
+} H2Stream;
+
+typedef struct {
+  int fd;
+  struct in_addr client;
+  unsigned char in[H2_FRAME_HEADER + H2_MAX_FRAME];
+  size_t in_len;
+  int preface_done;
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  long long window;       // connection-level send window
+  int initial_window;     // peer's SETTINGS_INITIAL_WINDOW_SIZE
+  size_t encoder_max;     // peer's SETTINGS_HEADER_TABLE_SIZE
+  size_t encoder_size;
+  int encoder_reset;      // emit a table size update before the next block
+  const char *indexed_name[H2_INDEXED_MAX];
+  char *indexed_value[H2_INDEXED_MAX];
+  int indexed_count;
+  HpackTable decoder;
+  unsigned int last_stream;
+  unsigned int header_stream;   // awaiting CONTINUATION, 0 if none
+  char *headers;          // header block being assembled
+  size_t headers_len;
+  size_t headers_cap;
+  H2Stream *streams;
+  int stream_count;
+  int stream_cap;
+  int closing;            // GOAWAY sent or received, close once drained
+  int draining;           // GOAWAY sent on handover, still reading so streams can finish
+  int dead;               // socket failed, close without writing
+  long long deadline;     // GOAWAY when idle until then
+} H2Conn;
+
+typedef struct {
+  char method[16];
+  char path[BUFFER_SIZE];
+} H2Request;
+
+// While a handler answers an HTTP/2 stream, send_all() collects its output
+// here and end_request() or park_connection() frame it
+H2Conn *h2_sink = NULL;
+unsigned int h2_sink_stream = 0;
+char *h2_captured = NULL;
+size_t h2_captured_len = 0;
+size_t h2_captured_cap = 0;
+int h2_connection_count = 0;
+// HPACK Huffman decoding tree, built on first use. Leaves are -(symbol + 1)
+int hpack_huffman_tree[256][2];
+int hpack_huffman_nodes = 0;
+
+// Connections held open by the main loop: new ones whose request hasn't
+// arrived yet, long-polls waiting for a newer version, /events subscribers
+// and HTTP/2 connections with their long-poll and /events streams. Kept
+// small since tens of thousands of these may be parked at once.
+typedef enum {
+  PARK_READ,
+  PARK_WAIT,
+  PARK_EVENTS,
+  PARK_H2
+} ParkType;
+
+typedef struct {
+  int fd;
+  unsigned char type;
+  unsigned char format;
+  unsigned char flags;
+  unsigned char route;
+  in_addr_t addr;
+  unsigned int bytes;
+  unsigned long version;
+  long long deadline;
+  long long started;
+  H2Conn *h2;             // set for HTTP/2 connections and their streams
+  unsigned int stream;
+} Parked;
+
+// Parked connections, parallel to poll_fds[POLL_FIXED...], after the
+// signal pipe, listening socket and upgrade readiness pipe
+#define POLL_FIXED 3
+Parked *parked = NULL;
+struct pollfd *poll_fds = NULL;
+int parked_count = 0;
+int parked_cap = 0;
+int parked_sockets = 0;   // less the HTTP/2 streams, which share a socket
+
 // Function prototypes
-void handle_client(int client_socket);
+void handle_client(int client_socket, struct in_addr client);
+void read_request(int client_socket, struct in_addr client, long long deadline);
+void begin_request(in_addr_t addr);
+void resume_request(const Parked *p);
+void end_request(int client_socket);
+int access_log_start();
+void access_log_stop();
 void add_patterns(char *spec, PatternType type);
+void compile_patterns();
+int set_env_source(const char *spec);
 void load_environment();
-void send_response(int client_socket, const char *content_type, const char *response);
-void send_binary_response(int client_socket, const char *content_type, const unsigned char *data, size_t len);
+void reload_environment();
+void send_response(int client_socket, const char *content_type, const char *response, int head);
+void send_binary_response(int client_socket, const char *content_type, const unsigned char *data, size_t len, int head);
 void send_error_response(int client_socket, const char *status, const char *message);
+void send_retry_response(int client_socket, const char *status, const char *message, int retry_after);
 /* void serve_file(int client_socket, const char *file_path, const char *content_type); */
-void handle_get_request(int client_socket, const char *path);
-void handle_var_request(int client_socket, const char *var_name);
-void serve_homepage(int client_socket);
-void serve_json(int client_socket, int pretty);
-void serve_yaml(int client_socket);
-void serve_shell(int client_socket, int export_mode);
-void serve_sys(int client_socket);
+int handle_request(int client_socket, const char *path, int flags, struct in_addr client);
+int handle_bulk_request(int client_socket, BulkFormat format, const RequestOptions *opts);
+void handle_var_request(int client_socket, const char *var_name, int flags);
+int route_homepage(int client_socket, const RequestOptions *opts);
+int route_icon(int client_socket, const RequestOptions *opts);
+int route_json(int client_socket, const RequestOptions *opts);
+int route_yaml(int client_socket, const RequestOptions *opts);
+int route_sh(int client_socket, const RequestOptions *opts);
+int route_sys(int client_socket, const RequestOptions *opts);
+int route_var(int client_socket, const RequestOptions *opts);
+int route_events(int client_socket, const RequestOptions *opts);
+int route_metrics(int client_socket, const RequestOptions *opts);
+int route_debug(int client_socket, const RequestOptions *opts);
+int add_rate_limit(const char *spec, int per_route);
+int limiter_check(struct in_addr client, int slot);
+char *render_homepage();
+char *render_json(int pretty);
+char *render_yaml();
+char *render_shell(int export_mode);
+void serve_sys(int client_socket, int flags);
+void serve_bulk(int client_socket, BulkFormat format, int flags);
+void serve_events(int client_socket, int flags);
+void send_not_modified(int client_socket);
+void send_request_timeout(int client_socket);
+int park_connection(int client_socket, ParkType type, BulkFormat format, int flags, unsigned long version, long long deadline);
+void unpark_connection(int index);
+void wake_parked();
+void expire_parked(long long now);
 char *escape_json(const char *input);
 char *escape_html(const char *input);
 char *escape_yaml(const char *input);
@@ -80,8 +722,37 @@ char *escape_url(const char *src);
 char* get_env_var_value(const char *key);
 int needs_yaml_quoting(const char *value);
 static int is_valid_var_name(const char *s);
+static int parse_query(const char *query, RequestOptions *opts);
+static char *build_response(const char *content_type, int text, const void *body, size_t len, size_t *header_len);
+static void send_all(int client_socket, const char *data, size_t len);
+static int percent_decode(char *dst, const char *src, size_t len, int plus_space);
+static unsigned long long hash_bytes(const char *data, size_t len);
+static long long now_ms(void);
+static long long now_us(void);
+static H2Conn *h2_start(int client_socket, struct in_addr client);
+static void h2_input(H2Conn *c, const char *data, size_t len);
+static int h2_upgrade(int client_socket, struct in_addr client, const char *request, size_t len,
+                      const char *method, const char *path);
+static void h2_capture(const char *data, size_t len);
+static void h2_park_stream(void);
+static void h2_end_stream(void);
+static void h2_on_ready(H2Conn *c, short revents);
+static void h2_service(long long now);
+static void h2_close(H2Conn *c, int graceful);
+static void h2_drain(H2Conn *c, long long deadline);
+static int park_send(const Parked *p, const char *data, size_t len);
 
 static volatile sig_atomic_t got_sigterm = 0;
+static volatile sig_atomic_t got_sighup = 0;
+static volatile sig_atomic_t got_sigusr2 = 0;
+// Self-pipe so signals reliably wake poll()
+static int signal_pipe[2] = { -1, -1 };
+
+static void wake_main_loop(void) {
+  int saved_errno = errno;
+  if (signal_pipe[1] >= 0) { (void)write(signal_pipe[1], "", 1); }
+  errno = saved_errno;
+}
 
 static void sigchld_handler(int sig) {
   (void)sig;
@@ -92,11 +763,230 @@ static void sigchld_handler(int sig) {
 static void sigterm_handler(int sig) {
   (void)sig;
   got_sigterm = 1;
+  wake_main_loop();
+}
+
+static void sighup_handler(int sig) {
+  (void)sig;
+  got_sighup = 1;
+  wake_main_loop();
+}
+
+static void sigusr2_handler(int sig) {
+  (void)sig;
+  got_sigusr2 = 1;
+  wake_main_loop();
+}
+
+// Takes ownership of a descriptor passed down by the previous server
+static int inherit_fd(const char *name) {
+  char *value = getenv(name);
+  if (!value) { return -1; }
+  int fd = atoi(value);
+  unsetenv(name); // Not to be served as part of the environment
+  if (fd < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) { return -1; }
+  return fd;
+}
+
+// Writes "VERSION\0KEY=VALUE\0..." to a memfd for the next server
+static int write_snapshot(void) {
+  int fd = memfd_create("envhttpd-snapshot", MFD_CLOEXEC);
+  if (fd < 0) {
+    perror("memfd_create failed");
+    return -1;
+  }
+  int failed = dprintf(fd, "%lu%c", env_version, '\0') < 0;
+  for (int i = 0; i < env_var_count && !failed; i++) {
+    failed = dprintf(fd, "%s=%s%c", env_vars[i].key, env_vars[i].value, '\0') < 0;
+  }
+  if (failed) {
+    perror("write snapshot failed");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Continues the previous server's version numbering, bumping it if our
+// freshly loaded environment differs from the one it was serving
+static void adopt_snapshot(int fd) {
+  struct stat st;
+  char *data;
+  if (fstat(fd, &st) < 0 || st.st_size == 0 || !(data = malloc(st.st_size + 1))) {
+    close(fd);
+    return;
+  }
+  ssize_t len = pread(fd, data, st.st_size, 0);
+  close(fd);
+  if (len <= 0) {
+    free(data);
+    return;
+  }
+  data[len] = '\0';
+  unsigned long version = strtoul(data, NULL, 10);
+  int count = 0;
+  int same = 1;
+  for (char *entry = data + strlen(data) + 1; entry < data + len; entry += strlen(entry) + 1) {
+    char *eq = strchr(entry, '=');
+    if (!eq) { continue; }
+    *eq = '\0';
+    const char *value = get_env_var_value(entry);
+    if (!value || strcmp(value, eq + 1) != 0) { same = 0; }
+    count++;
+  }
+  if (count != env_var_count) { same = 0; }
+  if (version > 0) {
+    env_version = same ? version : version + 1;
+  }
+  free(data);
+}
+
+// Forks and re-execs ourselves with the listening socket, returning the
+// read end of a pipe the new server reports readiness on
+static int start_upgrade(int server_fd, char *argv[]) {
+  int ready[2];
+  if (pipe(ready) < 0) {
+    perror("pipe failed");
+    return -1;
+  }
+  fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+  fcntl(ready[0], F_SETFL, fcntl(ready[0], F_GETFL) | O_NONBLOCK);
+  int snapshot = write_snapshot();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork failed");
+    close(ready[0]);
+    close(ready[1]);
+    if (snapshot >= 0) { close(snapshot); }
+    return -1;
+  }
+  if (pid == 0) {
+    char buf[16];
+    int fds[] = { server_fd, snapshot, ready[1] };
+    const char *names[] = { LISTEN_FD_ENV, SNAPSHOT_FD_ENV, READY_FD_ENV };
+    for (int i = 0; i < 3; i++) {
+      if (fds[i] < 0) { continue; }
+      fcntl(fds[i], F_SETFD, 0);
+      snprintf(buf, sizeof(buf), "%d", fds[i]);
+      setenv(names[i], buf, 1);
+    }
+    execvp(argv[0], argv);
+    perror("exec failed");
+    _exit(127);
+  }
+  close(ready[1]);
+  if (snapshot >= 0) { close(snapshot); }
+  printf("Upgrading: started pid %d\n", (int)pid);
+  fflush(stdout);
+  return ready[0];
+}
+
+// Once handed over, parked clients are told to come back, which lands them
+// on the new server, while HTTP/2 connections finish what they have started
+// and requests still on their way are answered here when they arrive
+static void drain_parked(long long deadline) {
+  for (int i = parked_count - 1; i >= 0; i--) {
+    // Draining an HTTP/2 connection ends several of its streams
+    if (i >= parked_count) { continue; }
+    Parked p = parked[i];
+    if (p.h2) {
+      h2_drain(p.h2, deadline);
+      continue;
+    }
+    if (p.type == PARK_READ) { continue; }
+    unpark_connection(i);
+    resume_request(&p);
+    if (p.type == PARK_WAIT) { send_not_modified(p.fd); }
+    end_request(p.fd);
+  }
+}
+
+// Parked clients are told to come back, which lands them on the new server
+static void release_parked(void) {
+  while (parked_count > 0) {
+    Parked p = parked[parked_count - 1];
+    if (p.h2) {
+      h2_close(p.h2, 1);
+      continue;
+    }
+    unpark_connection(parked_count - 1);
+    resume_request(&p);
+    if (p.type == PARK_WAIT) { send_not_modified(p.fd); }
+    if (p.type == PARK_READ) { send_request_timeout(p.fd); }
+    end_request(p.fd);
+  }
+}
+
+// Servers are our children, reparented to us as each one hands over, and
+// stay in our process group. Orphans left by docker exec sessions are
+// children too but in a group of their own, so they are left alone.
+static void forward_to_servers(int sig) {
+  DIR *proc = opendir("/proc");
+  if (!proc) {
+    perror("opendir /proc failed");
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(proc))) {
+    pid_t pid = atoi(entry->d_name);
+    if (pid <= 1) { continue; }
+    char path[64];
+    char stat[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { continue; }
+    ssize_t n = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (n <= 0) { continue; }
+    stat[n] = '\0';
+    // pid (comm) state ppid pgrp ..., where comm may hold anything
+    char *fields = strrchr(stat, ')');
+    int ppid, pgrp;
+    if (fields && sscanf(fields + 1, " %*c %d %d", &ppid, &pgrp) == 2 &&
+        ppid == getpid() && pgrp == getpgrp()) {
+      kill(pid, sig);
+    }
+  }
+  closedir(proc);
+}
+
+// As PID 1 (e.g. in docker) the container lives only as long as we do, so
+// after handing over stay behind as init: reap whichever server is current
+// and pass signals on to it
+static void run_as_init(void) {
+  int forwarded = 0;
+  // Here the signals have to interrupt waitpid() to be passed on
+  int signals[] = { SIGHUP, SIGUSR2 };
+  for (int i = 0; i < 2; i++) {
+    struct sigaction sa;
+    sigaction(signals[i], NULL, &sa);
+    sa.sa_flags &= ~SA_RESTART;
+    sigaction(signals[i], &sa, NULL);
+  }
+  while (1) {
+    if (got_sigterm && !forwarded) {
+      forwarded = 1;
+      kill(-1, SIGTERM); // Everything in our PID namespace but us
+    }
+    if (got_sighup) {
+      got_sighup = 0;
+      forward_to_servers(SIGHUP);
+    }
+    if (got_sigusr2) {
+      got_sigusr2 = 0;
+      forward_to_servers(SIGUSR2);
+    }
+    if (waitpid(-1, NULL, 0) < 0 && errno == ECHILD) { break; }
+  }
 }
 
 int main(int argc, char *argv[]) {
+  long long started = now_us();
+  int listen_fd = inherit_fd(LISTEN_FD_ENV);
+  int snapshot_fd = inherit_fd(SNAPSHOT_FD_ENV);
+  int ready_fd = inherit_fd(READY_FD_ENV);
   int opt;
-  while ((opt = getopt(argc, argv, "p:i:x:dDhH:")) != -1) {
+  while ((opt = getopt(argc, argv, "p:i:x:s:f:u:r:R:c:l:L:S:P:dDhH:")) != -1) {
     switch (opt) {
       case 'p':
         server_port = atoi(optarg);
@@ -107,6 +997,58 @@ int main(int argc, char *argv[]) {
       case 'x':
         add_patterns(optarg, PATTERN_EXCLUDE);
         break;
+      case 's':
+        if (set_env_source(optarg) < 0) {
+          fprintf(stderr, "Invalid env source: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'f':
+        env_source = SOURCE_FILE;
+        env_source_arg = optarg;
+        break;
+      case 'u':
+        refresh_interval = atoi(optarg);
+        break;
+      case 'r':
+        if (add_rate_limit(optarg, 0) < 0) {
+          fprintf(stderr, "Invalid rate limit: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'R':
+        if (add_rate_limit(optarg, 1) < 0) {
+          fprintf(stderr, "Invalid route rate limit: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'c':
+        max_connections = atoi(optarg);
+        break;
+      case 'l':
+        access_log_path = optarg;
+        break;
+      case 'L':
+        if (strcmp(optarg, "clf") == 0) {
+          access_log_clf = 1;
+        } else if (strcmp(optarg, "json") != 0) {
+          fprintf(stderr, "Invalid access log format: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'S':
+        access_log_sample = atoi(optarg);
+        if (access_log_sample < 1) { access_log_sample = 1; }
+        break;
+      case 'P':
+#ifdef ENVHTTPD_PROFILE
+        profiling = 1;
+        profile_trace_every = atoi(optarg);
+        break;
+#else
+        fprintf(stderr, "Profiling is not built in, rebuild with make PROFILE=1\n");
+        exit(EXIT_FAILURE);
+#endif
       case 'd':
         daemonize = 1;
         break;
@@ -129,6 +1071,30 @@ int main(int argc, char *argv[]) {
         printf("               of a container.\n");
         printf("  -x PATTERN   Exclude env vars matching the specified PATTERN.\n");
         printf("               Supports glob patterns (e.g., DEBUG*, TEMP).\n");
+        printf("  -s SOURCE    Where to read env vars from: env (the server's own,\n");
+        printf("               the default), proc:PID (another process's\n");
+        printf("               /proc/PID/environ) or file:FILE. Re-read on SIGHUP.\n");
+        printf("  -f FILE      Read env vars from FILE (KEY=VALUE lines), the same\n");
+        printf("               as -s file:FILE.\n");
+        printf("  -u SECONDS   Re-read the env source every SECONDS, updating only\n");
+        printf("               if its contents changed.\n");
+        printf("  -r RATE[:BURST]\n");
+        printf("               Limit each client IP to RATE requests per second,\n");
+        printf("               allowing bursts of BURST (default RATE). Excess\n");
+        printf("               requests get 429 Too Many Requests.\n");
+        printf("  -R ROUTE=RATE[:BURST]\n");
+        printf("               Per-client limit for one route (e.g., /=1:5), in\n");
+        printf("               addition to -r.\n");
+        printf("  -c MAX       Answer 503 Service Unavailable beyond MAX concurrent\n");
+        printf("               connections (including long-polls, /events and\n");
+        printf("               connections yet to send their request).\n");
+        printf("  -l FILE      Write an access log to FILE (- for stdout).\n");
+        printf("  -L FORMAT    Access log format, json (JSON lines, default) or\n");
+        printf("               clf (common log format plus latency).\n");
+        printf("  -S N         Log only one in every N requests.\n");
+        printf("  -P N         Serve /debug/profile with per-phase timings, tracing\n");
+        printf("               one request in N (0 for none). Needs a build with\n");
+        printf("               make PROFILE=1.\n");
         printf("  -d           Run the server as a daemon in the background.\n");
         printf("               (Does not make sense in a docker container)\n");
         printf("  -D           Enable debug mode logging and text/plain responses.\n");
@@ -142,6 +1108,18 @@ int main(int argc, char *argv[]) {
         printf("  /sh           Gets env vars in shell evaluatable format.\n");
         printf("  /sh?export    Gets env vars as shell with `export` prefix.\n");
         printf("  /var/VARNAME  Gets the value of the specified env var.\n");
+        printf("  /events       Streams changes as Server-Sent Events.\n");
+        printf("  /metrics      Gets connection and rate limiter counters.\n");
+        printf("\n");
+        printf("All endpoints also answer HEAD requests with headers only,\n");
+        printf("and HTTP/2 without TLS, by prior knowledge or Upgrade: h2c.\n");
+        printf("Bulk endpoints (/, /json, /yaml, /sh) accept ?wait=VERSION to\n");
+        printf("long-poll until the Env-Version is newer than VERSION, and\n");
+        printf("&timeout=SECONDS (default %d, max %d) after which they answer\n",
+               DEFAULT_WAIT_TIMEOUT, MAX_WAIT_TIMEOUT);
+        printf("304 Not Modified. SIGHUP re-reads the environment.\n");
+        printf("SIGUSR2 re-executes the binary, handing over the listening socket\n");
+        printf("for a zero-downtime upgrade.\n");
         printf("\n");
         printf("envhttpd - Copyright © 2024 Kilna, Anthony https://github.com/kilna/envhttpd\n");
         exit(EXIT_SUCCESS);
@@ -152,20 +1130,23 @@ int main(int argc, char *argv[]) {
         fprintf(
           stderr,
           "Usage: %s [-p port] [-i include_pattern|...] [-x exclude_pattern|...]"
-          " [-d] [-D] [-H hostname]\n",
+          " [-s source] [-f env_file] [-u seconds] [-r rate] [-R route=rate] [-c max] [-l log_file]"
+          " [-L json|clf] [-S sample] [-P trace_every] [-d] [-D] [-H hostname]\n",
           argv[0]
         );
         exit(EXIT_FAILURE);
     }
   }
+  compile_patterns();
   load_environment(); // Load env vars once at startup
+  if (snapshot_fd >= 0) { adopt_snapshot(snapshot_fd); }
 
   // Output the server link upon startup
   printf("Server is running at http://%s:%d\n", hostname, server_port);
   fflush(stdout);
 
-  // Daemonize if requested
-  if (daemonize) {
+  // Daemonize if requested, unless already detached by the previous server
+  if (daemonize && listen_fd < 0) {
     pid_t pid = fork();
     if (pid < 0) { perror("fork failed"); exit(EXIT_FAILURE); }
     if (pid > 0) { exit(EXIT_SUCCESS); } // Parent exits
@@ -175,16 +1156,32 @@ int main(int argc, char *argv[]) {
     freopen("/dev/null", "w", stdout);
     freopen("/dev/null", "w", stderr);
   }
-  int server_fd, client_socket, max_sd, activity;
+  if (access_log_path && access_log_start() < 0) {
+    exit(EXIT_FAILURE);
+  }
+#ifdef ENVHTTPD_PROFILE
+  prof_epoch_ticks = prof_ticks();
+  prof_epoch_ns = now_us() * 1000;
+#endif
+  int server_fd, client_socket, activity;
   struct sockaddr_in address;
   int addrlen = sizeof(address);
-  fd_set readfds;
-  if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+  {
+    // Each parked connection holds a descriptor, so allow as many as we can
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+      rl.rlim_cur = rl.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &rl);
+    }
+  }
+  if (listen_fd >= 0) {
+    server_fd = listen_fd;
+  } else if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
     perror("socket failed");
     exit(EXIT_FAILURE);
   }
   int opt_val = 1;
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt_val, sizeof(opt_val))) {
+  if (listen_fd < 0 && setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt_val, sizeof(opt_val))) {
     perror("setsockopt failed");
     close(server_fd);
     exit(EXIT_FAILURE);
@@ -192,164 +1189,2175 @@ int main(int argc, char *argv[]) {
   address.sin_family = AF_INET;
   address.sin_addr.s_addr = INADDR_ANY;
   address.sin_port = htons(server_port);
-  if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+  if (listen_fd < 0 && bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
     perror("bind failed");
     close(server_fd);
     exit(EXIT_FAILURE);
   }
-  if (listen(server_fd, 3) < 0) {
+  if (listen(server_fd, SOMAXCONN) < 0) {
     perror("listen failed");
     close(server_fd);
     exit(EXIT_FAILURE);
   }
+  fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+  if (pipe(signal_pipe) < 0) {
+    perror("pipe failed");
+    close(server_fd);
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(signal_pipe[i], F_SETFL, fcntl(signal_pipe[i], F_GETFL) | O_NONBLOCK);
+    fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
   {
     struct sigaction sa = {0};
-    sa.sa_handler = sigchld_handler;
     sigemptyset(&sa.sa_mask);
-    sigaction(SIGCHLD, &sa, NULL);
     sa.sa_handler = sigterm_handler;
     sigaction(SIGTERM, &sa, NULL);
     sigaction(SIGINT, &sa, NULL);
+    // Reloads and upgrades mustn't fail a read or write in progress; poll()
+    // is never restarted, so the self-pipe still wakes the main loop
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = sigchld_handler;
+    sigaction(SIGCHLD, &sa, NULL);
+    sa.sa_handler = sighup_handler;
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = sigusr2_handler;
+    sigaction(SIGUSR2, &sa, NULL);
+    // Parked clients may disappear while we write to them
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+  }
+  parked_cap = 64;
+  parked = malloc(parked_cap * sizeof(Parked));
+  poll_fds = malloc((POLL_FIXED + parked_cap) * sizeof(struct pollfd));
+  if (!parked || !poll_fds) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  if (ready_fd >= 0) {
+    // Tell the previous server we're up so it stops accepting and exits
+    char ready[64];
+    long long startup = now_us() - started;
+    int len = snprintf(ready, sizeof(ready), "%lld\n", startup);
+    printf("Took over from previous server, started in %.3f ms\n", startup / 1000.0);
+    fflush(stdout);
+    if (write(ready_fd, ready, len) != len) { perror("ready write failed"); }
+    close(ready_fd);
   }
-  FD_ZERO(&readfds); // Set of socket descriptors
+  int upgrade_fd = -1;
+  int handed_over = 0;
+  long long drain_deadline = 0;
+  long long upgrade_started = 0;
+  long long next_refresh = now_ms() + refresh_interval * 1000LL;
   while (1) {
     if (got_sigterm) break;
-    FD_ZERO(&readfds); // Clear the socket set
-    FD_SET(server_fd, &readfds); // Add server socket to set
-    max_sd = server_fd;
+    if (got_sighup) {
+      got_sighup = 0;
+      reload_environment();
+    }
+    if (refresh_interval > 0 && now_ms() >= next_refresh) {
+      reload_environment();
+      next_refresh = now_ms() + refresh_interval * 1000LL;
+    }
+    if (got_sigusr2) {
+      got_sigusr2 = 0;
+      if (upgrade_fd < 0 && !handed_over) {
+        upgrade_started = now_us();
+        upgrade_fd = start_upgrade(server_fd, argv);
+      }
+    }
+    poll_fds[0].fd = signal_pipe[0];
+    poll_fds[0].events = POLLIN;
+    poll_fds[1].fd = server_fd;
+    poll_fds[1].events = POLLIN;
+    poll_fds[2].fd = upgrade_fd;
+    poll_fds[2].events = POLLIN;
+    long long now = now_ms();
+    h2_service(now);
+    if (handed_over && (parked_count == 0 || now >= drain_deadline)) break;
+    // Sleep until the nearest long-poll deadline or /events heartbeat
+    int timeout = -1;
+    if (refresh_interval > 0) {
+      timeout = next_refresh > now ? (int)(next_refresh - now) : 0;
+    }
+    if (handed_over && (timeout < 0 || drain_deadline - now < timeout)) {
+      timeout = (int)(drain_deadline - now);
+    }
+    for (int i = 0; i < parked_count; i++) {
+      long long remaining = parked[i].deadline - now;
+      if (remaining < 0) { remaining = 0; }
+      if (timeout < 0 || remaining < timeout) { timeout = (int)remaining; }
+    }
     if (debug) { printf("Waiting for new connections...\n"); fflush(stdout); }
-    // Wait for an activity on one of the sockets
-    activity = select(max_sd + 1, &readfds, NULL, NULL, NULL);
+    activity = poll(poll_fds, POLL_FIXED + parked_count, timeout);
     if (activity < 0) {
-      if (errno == EINTR) { if (got_sigterm) break; continue; }
-      perror("select error");
+      if (errno == EINTR) { continue; }
+      perror("poll error");
+      continue;
     }
-    if (FD_ISSET(server_fd, &readfds)) {
-      if ((client_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-        perror("accept failed");
+    if (poll_fds[0].revents & POLLIN) {
+      char drain[64];
+      while (read(signal_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+    }
+    if (poll_fds[2].revents) {
+      // The new server either reports its startup time, or closes the pipe
+      // by failing to exec/start, in which case we carry on serving
+      char ready[64];
+      ssize_t n = read(upgrade_fd, ready, sizeof(ready) - 1);
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) { continue; }
+      close(upgrade_fd);
+      upgrade_fd = -1;
+      if (n <= 0) {
+        fprintf(stderr, "Upgrade failed, new server did not start\n");
+        continue;
+      }
+      ready[n] = '\0';
+      printf("Upgrade complete: new server started in %.3f ms, handover took %.3f ms\n",
+             atoll(ready) / 1000.0, (now_us() - upgrade_started) / 1000.0);
+      fflush(stdout);
+      handed_over = 1;
+      // Connections still in the accept queue now belong to the new server
+      close(server_fd);
+      server_fd = -1;
+      drain_deadline = now_ms() + HANDOVER_DRAIN * 1000LL;
+      drain_parked(drain_deadline);
+      continue;
+    }
+    // Parked clients only ever send us EOF or garbage; drop them either way.
+    // HTTP/2 connections are the exception and carry on with their frames,
+    // as are new connections, whose request has now arrived.
+    for (int i = parked_count - 1; i >= 0; i--) {
+      // An HTTP/2 connection may have ended several of its streams
+      if (i >= parked_count || !poll_fds[POLL_FIXED + i].revents) { continue; }
+      if (parked[i].type == PARK_H2) {
+        h2_on_ready(parked[i].h2, poll_fds[POLL_FIXED + i].revents);
         continue;
       }
+      if (parked[i].type == PARK_READ) {
+        // The request has arrived, or the client has gone
+        Parked p = parked[i];
+        unpark_connection(i);
+        resume_request(&p);
+        read_request(p.fd, (struct in_addr){ p.addr }, p.deadline);
+        continue;
+      }
+      char discard[256];
+      ssize_t n = recv(parked[i].fd, discard, sizeof(discard), MSG_DONTWAIT);
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        if (debug) { printf("Parked client (socket %d) went away.\n", parked[i].fd); fflush(stdout); }
+        Parked p = parked[i];
+        unpark_connection(i);
+        resume_request(&p);
+        end_request(p.fd);
+      }
+    }
+    expire_parked(now_ms());
+    // Drain a batch of pending connections so a poll() over many parked
+    // descriptors isn't paid once per accept
+    for (int i = 0; i < ACCEPT_BATCH && (poll_fds[1].revents & POLLIN); i++) {
+      PROF_BEGIN(ACCEPT);
+      if ((client_socket = accept4(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen, SOCK_CLOEXEC)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) { perror("accept failed"); }
+        break;
+      }
+      PROF_END(ACCEPT);
       if (debug) {
         printf("Accepted new connection.\n");
         fflush(stdout);
       }
-      handle_client(client_socket); // Handle the client in the same loop
+      if (max_connections > 0 && parked_sockets >= max_connections) {
+        // Shed before reading so an overloaded server stays cheap to refuse
+        // The request may not have arrived yet, so the answer has no body
+        // in case it turns out to be a HEAD
+        char discard[BUFFER_SIZE];
+        while (recv(client_socket, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+          ;
+        limiter_stats.shed++;
+        begin_request(address.sin_addr.s_addr);
+        static const char unavailable[] =
+          "HTTP/1.1 503 Service Unavailable\r\n"
+          "Content-Length: 0\r\n"
+          "Retry-After: 1\r\n"
+          "\r\n";
+        current_request.status = 503;
+        send_all(client_socket, unavailable, sizeof(unavailable) - 1);
+        end_request(client_socket);
+        continue;
+      }
+      handle_client(client_socket, address.sin_addr); // Handle the client in the same loop
+    }
+  }
+  if (server_fd >= 0) { close(server_fd); }
+  if (handed_over) {
+    release_parked();
+  }
+  access_log_stop();
+  if (handed_over && getpid() == 1) { run_as_init(); }
+  return 0;
+}
+
+void handle_client(int client_socket, struct in_addr client) {
+  if (debug) {
+    printf("Handling new client (socket %d).\n", client_socket);
+    fflush(stdout);
+  }
+  begin_request(client.s_addr);
+  read_request(client_socket, client, now_ms() + REQUEST_TIMEOUT * 1000LL);
+}
+
+// Answers the request if it has arrived, otherwise parks the connection
+// until it does so an idle client can't hold up the main loop
+void read_request(int client_socket, struct in_addr client, long long deadline) {
+  char buffer[BUFFER_SIZE];
+  PROF_BEGIN(RECV);
+  ssize_t bytes_read;
+  do {
+    bytes_read = recv(client_socket, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+  } while (bytes_read < 0 && errno == EINTR);
+  PROF_END(RECV);
+  if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    if (!park_connection(client_socket, PARK_READ, BULK_NONE, 0, 0, deadline)) {
+      close(client_socket);
+    }
+    return;
+  }
+  if (bytes_read < 0) {
+    perror("recv failed");
+    close(client_socket);
+    return;
+  }
+  if (bytes_read == 0) {
+    close(client_socket);
+    return;
+  }
+  buffer[bytes_read] = '\0';
+  if (bytes_read >= 3 && memcmp(buffer, H2_PREFACE, bytes_read < H2_PREFACE_LEN ? bytes_read : H2_PREFACE_LEN) == 0) {
+    // HTTP/2 with prior knowledge
+    H2Conn *c = h2_start(client_socket, client);
+    if (c) {
+      h2_input(c, buffer, bytes_read);
+    } else {
+      close(client_socket);
     }
+    return;
+  }
+
+  PROF_BEGIN(PARSE);
+  // Known before the request line is, so even a 400 is headers only
+  if (strncmp(buffer, "HEAD ", 5) == 0) { current_request.flags = OPT_HEAD; }
+  char *line_end = strpbrk(buffer, "\r\n");
+  if (!line_end) {
+    send_error_response(client_socket, "400 Bad Request",
+                        "Request line too long or invalid");
+    end_request(client_socket);
+    return;
+  }
+  *line_end = '\0';
+
+  char method[MAX_METHOD_LEN + 1];
+  char path[MAX_PATH_LEN + 1];
+  int n = sscanf(buffer, "%7s %1023s", method, path);
+  if (n != 2) {
+    send_error_response(client_socket, "400 Bad Request", "Bad Request");
+    end_request(client_socket);
+    return;
+  }
+  int flags = 0;
+  if (strcmp(method, "HEAD") == 0) {
+    flags |= OPT_HEAD;
+  } else if (strcmp(method, "GET") != 0) {
+    send_error_response(client_socket, "405 Method Not Allowed",
+                        "Method Not Allowed");
+    end_request(client_socket);
+    return;
+  }
+  PROF_END(PARSE);
+  if (h2_upgrade(client_socket, client, line_end + 1, buffer + bytes_read - (line_end + 1), method, path)) {
+    return;
+  }
+  current_request.flags = flags;
+  if (debug) {
+    printf("Received request: Method=%s, Path=%s\n", method, path);
+    fflush(stdout);
+  }
+  if (!handle_request(client_socket, path, flags, client)) {
+    end_request(client_socket);
+  }
+}
+
+static const Route routes[ROUTE_SLOTS] = {
+#define ROUTE(slot, path, prefix, handler) [slot] = { path, sizeof(path) - 1, prefix, handler }
+  ROUTE(ROUTE_SLOT_ROOT, "/", 0, route_homepage),
+  ROUTE(ROUTE_SLOT_ICON_PNG, "/icon.png", 0, route_icon),
+  ROUTE(ROUTE_SLOT_JSON, "/json", 0, route_json),
+  ROUTE(ROUTE_SLOT_YAML, "/yaml", 0, route_yaml),
+  ROUTE(ROUTE_SLOT_SH, "/sh", 0, route_sh),
+  ROUTE(ROUTE_SLOT_SYS, "/sys", 0, route_sys),
+  ROUTE(ROUTE_SLOT_VAR, "/var", 1, route_var),
+  ROUTE(ROUTE_SLOT_EVENTS, "/events", 0, route_events),
+  ROUTE(ROUTE_SLOT_METRICS, "/metrics", 0, route_metrics),
+  ROUTE(ROUTE_SLOT_DEBUG, "/debug", 1, route_debug),
+#undef ROUTE
+};
+
+// Returns 1 if the connection was handed off (parked) rather than finished
+int handle_request(int client_socket, const char *path, int flags, struct in_addr client) {
+  PROF_BEGIN(ROUTE);
+  char decoded[MAX_PATH_LEN + 1];
+  const char *query = strchr(path, '?');
+  size_t path_len = query ? (size_t)(query - path) : strlen(path);
+  RequestOptions opts = { .flags = flags, .timeout = DEFAULT_WAIT_TIMEOUT };
+  if (percent_decode(decoded, path, path_len, 0) < 0 ||
+      (query && parse_query(query + 1, &opts) < 0)) {
+    send_error_response(client_socket, "400 Bad Request", "Bad Request");
+    return 0;
+  }
+  if (decoded[0] != '/') {
+    send_error_response(client_socket, "404 Not Found", "Not Found");
+    return 0;
+  }
+  // Route on the first segment, prefix routes get the remainder
+  const char *rest = strchr(decoded + 1, '/');
+  size_t len = rest ? (size_t)(rest - decoded) : strlen(decoded);
+  const Route *route = &routes[ROUTE_HASH(decoded, len)];
+  if (!route->handler || route->len != len || memcmp(route->path, decoded, len) != 0 ||
+      !rest != !route->prefix) {
+    send_error_response(client_socket, "404 Not Found", "Not Found");
+    return 0;
+  }
+  PROF_END(ROUTE);
+  current_request.route = route - routes;
+  // Refuse before any rendering
+  PROF_BEGIN(LIMIT);
+  int retry_after = limiter_check(client, route - routes);
+  PROF_END(LIMIT);
+  if (retry_after) {
+    send_retry_response(client_socket, "429 Too Many Requests", "Too Many Requests", retry_after);
+    return 0;
+  }
+  opts.rest = rest ? rest + 1 : "";
+  return route->handler(client_socket, &opts);
+}
+
+void begin_request(in_addr_t addr) {
+  current_request.addr = addr;
+  current_request.route = ROUTE_SLOTS;
+  current_request.flags = 0;
+  current_request.status = 0;
+  current_request.bytes = 0;
+  current_request.started = access_log_fd >= 0 ? now_us() : 0;
+  h2_sink = NULL;
+  h2_captured_len = 0;
+  PROF_REQUEST_BEGIN(0);
+}
+
+// Makes a parked connection the current request again to finish it
+void resume_request(const Parked *p) {
+  current_request.addr = p->addr;
+  current_request.route = p->route;
+  current_request.flags = p->flags;
+  current_request.status = p->type == PARK_EVENTS ? 200 : 0;
+  current_request.bytes = p->bytes;
+  current_request.started = p->started;
+  h2_sink = p->h2;
+  h2_sink_stream = p->stream;
+  h2_captured_len = 0;
+  PROF_REQUEST_BEGIN(1);
+}
+
+// Queues the access log record for the current request and closes it, or
+// ends its stream on HTTP/2
+void end_request(int client_socket) {
+  static int sample_count = 0;
+  if (h2_sink) {
+    h2_end_stream();
+    h2_sink = NULL;
+  } else {
+    close(client_socket);
+  }
+  PROF_REQUEST_END(1);
+  if (access_log_fd < 0 || ++sample_count < access_log_sample) { return; }
+  sample_count = 0;
+  unsigned head = atomic_load_explicit(&access_head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&access_tail, memory_order_acquire);
+  if (head - tail >= ACCESS_LOG_SIZE) {
+    atomic_fetch_add_explicit(&access_dropped, 1, memory_order_relaxed);
+    return;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  AccessRecord *r = &access_ring[head & (ACCESS_LOG_SIZE - 1)];
+  r->time = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  r->addr = current_request.addr;
+  r->latency = (unsigned int)(now_us() - current_request.started);
+  r->bytes = (unsigned int)current_request.bytes;
+  r->status = current_request.status;
+  r->route = current_request.route;
+  r->flags = current_request.flags;
+  atomic_store_explicit(&access_head, head + 1, memory_order_release);
+}
+
+// Formats one record as a JSON line or common log format plus latency
+static int format_access_record(char *buf, size_t size, const AccessRecord *r) {
+  static const char *months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+  };
+  time_t secs = (time_t)(r->time / 1000000);
+  struct tm tm;
+  gmtime_r(&secs, &tm);
+  unsigned char *ip = (unsigned char *)&r->addr;
+  const char *route = r->route < ROUTE_SLOTS ? routes[r->route].path : "-";
+  const char *method = (r->flags & OPT_HEAD) ? "HEAD" : "GET";
+  if (access_log_clf) {
+    return snprintf(buf, size,
+                    "%u.%u.%u.%u - - [%02d/%s/%04d:%02d:%02d:%02d +0000] \"%s %s HTTP/1.1\" %u %u %u\n",
+                    ip[0], ip[1], ip[2], ip[3], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900,
+                    tm.tm_hour, tm.tm_min, tm.tm_sec, method, route, r->status, r->bytes, r->latency);
+  }
+  return snprintf(buf, size,
+                  "{\"time\":\"%04d-%02d-%02dT%02d:%02d:%02d.%06dZ\",\"client\":\"%u.%u.%u.%u\","
+                  "\"method\":\"%s\",\"route\":\"%s\",\"status\":%u,\"bytes\":%u,\"latency_us\":%u}\n",
+                  tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                  (int)(r->time % 1000000), ip[0], ip[1], ip[2], ip[3],
+                  method, route, r->status, r->bytes, r->latency);
+}
+
+// Log thread: every ACCESS_LOG_FLUSH_MS, writes out whatever has queued.
+// Sticks to snprintf and write so it never holds locks the main thread's
+// fork() for an upgrade could inherit.
+static void *access_log_main(void *arg) {
+  (void)arg;
+  static char batch[BUFFER_SIZE * 64];
+  while (1) {
+    int stopping = atomic_load(&access_log_stopping);
+    unsigned tail = atomic_load_explicit(&access_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&access_head, memory_order_acquire);
+    size_t len = 0;
+    for (; tail != head; tail++) {
+      if (sizeof(batch) - len < BUFFER_SIZE) {
+        if (write(access_log_fd, batch, len) < 0) { /* nothing better to do */ }
+        len = 0;
+      }
+      len += format_access_record(batch + len, sizeof(batch) - len,
+                                  &access_ring[tail & (ACCESS_LOG_SIZE - 1)]);
+      atomic_fetch_add_explicit(&access_written, 1, memory_order_relaxed);
+    }
+    if (len > 0 && write(access_log_fd, batch, len) < 0) { /* dropped */ }
+    atomic_store_explicit(&access_tail, tail, memory_order_release);
+    if (stopping) { break; }
+    struct timespec delay = { 0, ACCESS_LOG_FLUSH_MS * 1000000L };
+    nanosleep(&delay, NULL);
+  }
+  return NULL;
+}
+
+int access_log_start() {
+  if (strcmp(access_log_path, "-") == 0) {
+    access_log_fd = dup(STDOUT_FILENO);
+    if (access_log_fd >= 0) { fcntl(access_log_fd, F_SETFD, FD_CLOEXEC); }
+  } else {
+    access_log_fd = open(access_log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  }
+  if (access_log_fd < 0) {
+    perror("open access log failed");
+    return -1;
+  }
+  // Signals belong to the main loop
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int rc = pthread_create(&access_log_thread, NULL, access_log_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc != 0) {
+    fprintf(stderr, "pthread_create failed: %s\n", strerror(rc));
+    close(access_log_fd);
+    access_log_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+// Flushes what's queued and stops the log thread
+void access_log_stop() {
+  if (access_log_fd < 0) { return; }
+  atomic_store(&access_log_stopping, 1);
+  pthread_join(access_log_thread, NULL);
+  close(access_log_fd);
+  access_log_fd = -1;
+}
+
+// RFC 7541 Appendix B, by symbol
+static const unsigned int hpack_huffman_codes[256] = {
+  0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+  0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+  0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+  0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+  0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+  0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+  0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+  0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+  0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+  0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+  0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+  0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+  0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+  0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+  0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+  0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+  0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+  0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+  0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+  0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+  0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+  0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+  0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+  0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+  0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+  0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+  0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+  0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+  0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+  0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+  0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+  0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+  0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+  0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+  0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+  0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+  0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+  0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+  0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+  0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+  0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+  0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+  0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const unsigned char hpack_huffman_lengths[256] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+// RFC 7541 Appendix A, from index 1
+static const char *hpack_static_table[HPACK_STATIC_COUNT + 1][2] = {
+  { NULL, NULL },
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+
+// Appends to a growable buffer, returns -1 if out of memory
+static int buffer_append(char **buf, size_t *len, size_t *cap, const void *data, size_t n) {
+  if (*len + n > *cap) {
+    size_t new_cap = *cap ? *cap : BUFFER_SIZE;
+    while (new_cap < *len + n) { new_cap *= 2; }
+    char *bigger = realloc(*buf, new_cap);
+    if (!bigger) { return -1; }
+    *buf = bigger;
+    *cap = new_cap;
+  }
+  if (n > 0) { memcpy(*buf + *len, data, n); }
+  *len += n;
+  return 0;
+}
+
+static unsigned long read_u32(const unsigned char *p) {
+  return (unsigned long)p[0] << 24 | (unsigned long)p[1] << 16 | (unsigned long)p[2] << 8 | p[3];
+}
+
+static char *memdup0(const char *s, size_t len) {
+  char *copy = malloc(len + 1);
+  if (copy) {
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+  }
+  return copy;
+}
+
+static void h2_frame(H2Conn *c, H2FrameType type, int flags, unsigned int stream,
+                     const void *payload, size_t len) {
+  if (c->dead) { return; }
+  unsigned char header[H2_FRAME_HEADER] = {
+    len >> 16, len >> 8, len, type, flags, (stream >> 24) & 0x7f, stream >> 16, stream >> 8, stream
+  };
+  if (buffer_append(&c->out, &c->out_len, &c->out_cap, header, sizeof(header)) < 0 ||
+      buffer_append(&c->out, &c->out_len, &c->out_cap, payload, len) < 0) {
+    perror("realloc failed");
+    c->dead = 1;
+  }
+}
+
+static void h2_rst_stream(H2Conn *c, unsigned int id, H2Error error) {
+  unsigned char payload[4] = { 0, 0, 0, error };
+  h2_frame(c, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+static void h2_window_update(H2Conn *c, unsigned int id, size_t increment) {
+  unsigned char payload[4] = { increment >> 24, increment >> 16, increment >> 8, increment };
+  h2_frame(c, H2_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+static H2Stream *h2_find_stream(H2Conn *c, unsigned int id) {
+  for (int i = 0; i < c->stream_count; i++) {
+    if (c->streams[i].id == id) { return &c->streams[i]; }
+  }
+  return NULL;
+}
+
+static H2Stream *h2_add_stream(H2Conn *c, unsigned int id) {
+  if (c->stream_count == c->stream_cap) {
+    int cap = c->stream_cap ? c->stream_cap * 2 : 8;
+    H2Stream *streams = realloc(c->streams, cap * sizeof(H2Stream));
+    if (!streams) {
+      perror("realloc failed");
+      return NULL;
+    }
+    c->streams = streams;
+    c->stream_cap = cap;
+  }
+  H2Stream *s = &c->streams[c->stream_count++];
+  memset(s, 0, sizeof(*s));
+  s->id = id;
+  s->window = c->initial_window;
+  return s;
+}
+
+// Order is not preserved
+static void h2_remove_stream(H2Conn *c, H2Stream *s) {
+  free(s->pending);
+  *s = c->streams[--c->stream_count];
+}
+
+// Sends as much pending DATA as both flow control windows allow
+static void h2_pump(H2Conn *c, H2Stream *s) {
+  while (!s->end_sent && !c->dead) {
+    size_t left = s->pending_len - s->pending_off;
+    long long n = left < H2_MAX_FRAME ? (long long)left : H2_MAX_FRAME;
+    if (n > s->window) { n = s->window > 0 ? s->window : 0; }
+    if (n > c->window) { n = c->window > 0 ? c->window : 0; }
+    if (left > 0 && n == 0) { break; }
+    if (left == 0 && !s->end_stream) { break; }
+    int end = s->end_stream && (size_t)n == left;
+    h2_frame(c, H2_DATA, end ? H2_FLAG_END_STREAM : 0, s->id, s->pending + s->pending_off, n);
+    s->pending_off += n;
+    s->window -= n;
+    c->window -= n;
+    s->end_sent = end;
+  }
+  if (s->pending_off == s->pending_len) {
+    s->pending_off = 0;
+    s->pending_len = 0;
+  }
+}
+
+// Pumps a stream, dropping it once everything has been sent
+static void h2_advance(H2Conn *c, H2Stream *s) {
+  h2_pump(c, s);
+  if (s->end_sent && !s->parked) { h2_remove_stream(c, s); }
+}
+
+static void h2_advance_all(H2Conn *c) {
+  for (int i = c->stream_count - 1; i >= 0; i--) {
+    h2_advance(c, &c->streams[i]);
+  }
+}
+
+static int h2_queue(H2Stream *s, const char *data, size_t len) {
+  if (s->pending_off > 0) {
+    memmove(s->pending, s->pending + s->pending_off, s->pending_len - s->pending_off);
+    s->pending_len -= s->pending_off;
+    s->pending_off = 0;
+  }
+  return buffer_append(&s->pending, &s->pending_len, &s->pending_cap, data, len);
+}
+
+// Ends a stream that was never answered, finishing its parked request
+static void h2_cancel_stream(H2Conn *c, unsigned int id) {
+  H2Stream *s = h2_find_stream(c, id);
+  if (!s) { return; }
+  int was_parked = s->parked;
+  h2_remove_stream(c, s);
+  for (int i = parked_count - 1; was_parked && i >= 0; i--) {
+    if (parked[i].h2 == c && parked[i].type != PARK_H2 && parked[i].stream == id) {
+      Parked p = parked[i];
+      unpark_connection(i);
+      resume_request(&p);
+      end_request(p.fd);
+      break;
+    }
+  }
+}
+
+// Errors abandon every stream; NO_ERROR lets the open ones finish
+static void h2_goaway(H2Conn *c, H2Error error) {
+  unsigned int last = c->last_stream;
+  unsigned char payload[8] = {
+    (last >> 24) & 0x7f, last >> 16, last >> 8, last, 0, 0, 0, error
+  };
+  h2_frame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+  c->closing = 1;
+  while (error != H2_NO_ERROR && c->stream_count > 0) {
+    h2_cancel_stream(c, c->streams[c->stream_count - 1].id);
+  }
+}
+
+static size_t hpack_int(unsigned char *out, int prefix_bits, unsigned char first, unsigned long value) {
+  unsigned long max = (1UL << prefix_bits) - 1;
+  if (value < max) {
+    out[0] = first | value;
+    return 1;
+  }
+  out[0] = first | max;
+  value -= max;
+  size_t n = 1;
+  while (value >= 128) {
+    out[n++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+// Without Huffman coding, which would cost more CPU than the bytes it saves
+static size_t hpack_string(unsigned char *out, const char *s, size_t len) {
+  size_t n = hpack_int(out, 7, 0, len);
+  memcpy(out + n, s, len);
+  return n + len;
+}
+
+// Encodes one response header. Content-Type and Hostname repeat on every
+// response, so each value is put into the peer's dynamic table once and
+// is a single byte from then on. We never insert past the table's size, so
+// the peer never evicts and the indexes stay put.
+static size_t hpack_field(H2Conn *c, unsigned char *out, const char *name,
+                          const char *value, size_t value_len) {
+  int static_index = 0;
+  for (int i = 1; i <= HPACK_STATIC_COUNT && !static_index; i++) {
+    if (strcmp(hpack_static_table[i][0], name) == 0) { static_index = i; }
+  }
+  const char *indexable = strcmp(name, "content-type") == 0 ? "content-type"
+                        : strcmp(name, "hostname") == 0 ? "hostname" : NULL;
+  size_t n = 0;
+  if (indexable) {
+    for (int i = 0; i < c->indexed_count; i++) {
+      if (c->indexed_name[i] == indexable && strlen(c->indexed_value[i]) == value_len &&
+          memcmp(c->indexed_value[i], value, value_len) == 0) {
+        return hpack_int(out, 7, 0x80, HPACK_STATIC_COUNT + c->indexed_count - i);
+      }
+    }
+    size_t entry_size = strlen(name) + value_len + 32;
+    char *copy = NULL;
+    if (c->indexed_count < H2_INDEXED_MAX && c->encoder_size + entry_size <= c->encoder_max &&
+        (copy = memdup0(value, value_len))) {
+      c->indexed_name[c->indexed_count] = indexable;
+      c->indexed_value[c->indexed_count++] = copy;
+      c->encoder_size += entry_size;
+      if (static_index) {
+        n = hpack_int(out, 6, 0x40, static_index);
+      } else {
+        out[0] = 0x40;
+        n = 1 + hpack_string(out + 1, name, strlen(name));
+      }
+      return n + hpack_string(out + n, value, value_len);
+    }
+  }
+  // Literal without indexing
+  if (static_index) {
+    n = hpack_int(out, 4, 0, static_index);
+  } else {
+    out[0] = 0;
+    n = 1 + hpack_string(out + 1, name, strlen(name));
+  }
+  return n + hpack_string(out + n, value, value_len);
+}
+
+// Sends the head of a captured HTTP/1.1 response as HEADERS, -1 if invalid
+static int h2_send_head(H2Conn *c, H2Stream *s, const char *head, size_t head_len, int end_stream) {
+  if (head_len < 16 || strncmp(head, "HTTP/1.1 ", 9) != 0) { return -1; }
+  unsigned char *block = malloc(head_len * 2 + 64);
+  if (!block) {
+    perror("malloc failed");
+    return -1;
+  }
+  size_t n = 0;
+  if (c->encoder_reset) {
+    // Empty the peer's table before using its new size
+    n += hpack_int(block + n, 5, 0x20, 0);
+    n += hpack_int(block + n, 5, 0x20, c->encoder_max);
+    for (int i = 0; i < c->indexed_count; i++) { free(c->indexed_value[i]); }
+    c->indexed_count = 0;
+    c->encoder_size = 0;
+    c->encoder_reset = 0;
+  }
+  char status[4] = { head[9], head[10], head[11], '\0' };
+  int status_index = 0;
+  for (int i = 8; i <= 14; i++) {
+    if (strcmp(hpack_static_table[i][1], status) == 0) { status_index = i; }
+  }
+  if (status_index) {
+    n += hpack_int(block + n, 7, 0x80, status_index);
+  } else {
+    n += hpack_int(block + n, 4, 0, 8);
+    n += hpack_string(block + n, status, 3);
+  }
+  const char *end = head + head_len - 2;
+  const char *line = memmem(head, head_len, "\r\n", 2) + 2;
+  while (line < end) {
+    const char *eol = memmem(line, end - line, "\r\n", 2);
+    const char *colon = memchr(line, ':', eol - line);
+    char name[64];
+    size_t name_len = colon ? (size_t)(colon - line) : 0;
+    if (name_len > 0 && name_len < sizeof(name)) {
+      for (size_t i = 0; i < name_len; i++) { name[i] = tolower((unsigned char)line[i]); }
+      name[name_len] = '\0';
+      const char *value = colon + 1;
+      while (value < eol && *value == ' ') { value++; }
+      // Connection-specific headers are not allowed in HTTP/2
+      if (strcmp(name, "connection") != 0 && strcmp(name, "upgrade") != 0) {
+        n += hpack_field(c, block + n, name, value, eol - value);
+      }
+    }
+    line = eol + 2;
+  }
+  size_t off = 0;
+  do {
+    size_t chunk = n - off < H2_MAX_FRAME ? n - off : H2_MAX_FRAME;
+    int flags = (off + chunk == n ? H2_FLAG_END_HEADERS : 0) |
+                (off == 0 && end_stream ? H2_FLAG_END_STREAM : 0);
+    h2_frame(c, off == 0 ? H2_HEADERS : H2_CONTINUATION, flags, s->id, block + off, chunk);
+    off += chunk;
+  } while (off < n);
+  free(block);
+  return 0;
+}
+
+// Called by send_all() while a handler answers an HTTP/2 stream
+static void h2_capture(const char *data, size_t len) {
+  if (buffer_append(&h2_captured, &h2_captured_len, &h2_captured_cap, data, len) < 0) {
+    perror("realloc failed");
+  }
+}
+
+// Frames what the handler for the current stream has written so far
+static void h2_flush(int end) {
+  H2Conn *c = h2_sink;
+  H2Stream *s = h2_find_stream(c, h2_sink_stream);
+  size_t len = h2_captured_len;
+  h2_captured_len = 0;
+  if (!s || c->dead) { return; } // Reset by the peer meanwhile
+  const char *body = h2_captured;
+  if (!s->headers_sent && len > 0) {
+    const char *head_end = memmem(h2_captured, len, "\r\n\r\n", 4);
+    size_t head_len = head_end ? (size_t)(head_end + 4 - h2_captured) : 0;
+    int end_headers = end && (head_len == len || s->head);
+    if (!head_end || h2_send_head(c, s, h2_captured, head_len, end_headers) < 0) {
+      h2_rst_stream(c, s->id, H2_PROTOCOL_ERROR);
+      h2_remove_stream(c, s);
+      return;
+    }
+    s->headers_sent = 1;
+    s->end_sent = end_headers;
+    body += head_len;
+    len -= head_len;
+  } else if (!s->headers_sent && end) {
+    h2_rst_stream(c, s->id, H2_NO_ERROR);
+    h2_remove_stream(c, s);
+    return;
+  }
+  if (s->head) { len = 0; }
+  if (len > 0 && h2_queue(s, body, len) < 0) {
+    perror("realloc failed");
+    h2_rst_stream(c, s->id, H2_PROTOCOL_ERROR);
+    h2_remove_stream(c, s);
+    return;
+  }
+  s->end_stream |= end;
+  h2_advance(c, s);
+}
+
+// The handler parked the stream as a long-poll or /events subscription
+static void h2_park_stream(void) {
+  H2Stream *s = h2_find_stream(h2_sink, h2_sink_stream);
+  if (s) { s->parked = 1; }
+  h2_flush(0);
+}
+
+static void h2_end_stream(void) {
+  H2Stream *s = h2_find_stream(h2_sink, h2_sink_stream);
+  if (s) { s->parked = 0; }
+  h2_flush(1);
+}
+
+// Queues /events data on a parked stream, -1 if the peer isn't keeping up
+static int h2_stream_send(H2Conn *c, unsigned int id, const char *data, size_t len) {
+  H2Stream *s = h2_find_stream(c, id);
+  if (!s || c->dead || s->pending_len - s->pending_off + len > H2_MAX_PENDING ||
+      h2_queue(s, data, len) < 0) {
+    return -1;
+  }
+  h2_pump(c, s);
+  return 0;
+}
+
+static void hpack_build_tree(void) {
+  hpack_huffman_nodes = 1;
+  for (int sym = 0; sym < 256; sym++) {
+    int node = 0;
+    for (int bit = hpack_huffman_lengths[sym] - 1; bit > 0; bit--) {
+      int b = (hpack_huffman_codes[sym] >> bit) & 1;
+      if (!hpack_huffman_tree[node][b]) { hpack_huffman_tree[node][b] = hpack_huffman_nodes++; }
+      node = hpack_huffman_tree[node][b];
+    }
+    hpack_huffman_tree[node][hpack_huffman_codes[sym] & 1] = -(sym + 1);
+  }
+}
+
+static int hpack_huffman_decode(const unsigned char *in, size_t len, char *out) {
+  if (!hpack_huffman_nodes) { hpack_build_tree(); }
+  int node = 0;
+  int depth = 0;    // bits since the last symbol
+  int ones = 1;     // and whether they were all ones
+  size_t n = 0;
+  for (size_t i = 0; i < len; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      int b = (in[i] >> bit) & 1;
+      int next = hpack_huffman_tree[node][b];
+      if (next < 0) {
+        out[n++] = (char)(-next - 1);
+        node = 0;
+        depth = 0;
+        ones = 1;
+      } else if (next == 0) {
+        return -1; // EOS, or not a code
+      } else {
+        node = next;
+        depth++;
+        ones &= b;
+      }
+    }
+  }
+  // Padding is the first few bits of EOS, all ones
+  if (depth > 7 || !ones) { return -1; }
+  return (int)n;
+}
+
+static int hpack_read_int(const unsigned char **p, const unsigned char *end, int prefix_bits,
+                          unsigned long *value) {
+  unsigned long max = (1UL << prefix_bits) - 1;
+  *value = *(*p)++ & max;
+  if (*value < max) { return 0; }
+  for (int shift = 0; shift < 28; shift += 7) {
+    if (*p >= end) { return -1; }
+    unsigned char byte = *(*p)++;
+    *value += (unsigned long)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) { return 0; }
+  }
+  return -1;
+}
+
+static char *hpack_read_string(const unsigned char **p, const unsigned char *end, size_t *len) {
+  if (*p >= end) { return NULL; }
+  int huffman = **p & 0x80;
+  unsigned long raw_len;
+  if (hpack_read_int(p, end, 7, &raw_len) < 0 || raw_len > (unsigned long)(end - *p)) {
+    return NULL;
+  }
+  char *s;
+  if (huffman) {
+    // The shortest code is 5 bits
+    s = malloc(raw_len * 8 / 5 + 1);
+    int n = s ? hpack_huffman_decode(*p, raw_len, s) : -1;
+    if (n < 0) {
+      free(s);
+      return NULL;
+    }
+    s[n] = '\0';
+    *len = n;
+  } else {
+    s = memdup0((const char *)*p, raw_len);
+    if (!s) { return NULL; }
+    *len = raw_len;
+  }
+  *p += raw_len;
+  return s;
+}
+
+static void hpack_evict(HpackTable *t, size_t max_size) {
+  int evicted = 0;
+  while (evicted < t->count && t->size > max_size) {
+    HpackEntry *e = &t->entries[evicted++];
+    t->size -= e->name_len + e->value_len + 32;
+    free(e->name);
+    free(e->value);
+  }
+  if (evicted > 0) {
+    memmove(t->entries, t->entries + evicted, (t->count - evicted) * sizeof(HpackEntry));
+    t->count -= evicted;
+  }
+}
+
+// Takes ownership of name and value
+static int hpack_insert(HpackTable *t, char *name, size_t name_len, char *value, size_t value_len) {
+  size_t size = name_len + value_len + 32;
+  hpack_evict(t, size > t->max_size ? 0 : t->max_size - size);
+  if (size > t->max_size) {
+    // Too big for the table, which just leaves it empty
+    free(name);
+    free(value);
+    return 0;
+  }
+  if (t->count == t->cap) {
+    int cap = t->cap ? t->cap * 2 : 16;
+    HpackEntry *entries = realloc(t->entries, cap * sizeof(HpackEntry));
+    if (!entries) {
+      free(name);
+      free(value);
+      return -1;
+    }
+    t->entries = entries;
+    t->cap = cap;
+  }
+  t->entries[t->count++] = (HpackEntry){ name, name_len, value, value_len };
+  t->size += size;
+  return 0;
+}
+
+static int hpack_lookup(const HpackTable *t, unsigned long index, const char **name, size_t *name_len,
+                        const char **value, size_t *value_len) {
+  if (index == 0) { return -1; }
+  if (index <= HPACK_STATIC_COUNT) {
+    *name = hpack_static_table[index][0];
+    *name_len = strlen(*name);
+    *value = hpack_static_table[index][1];
+    *value_len = strlen(*value);
+    return 0;
+  }
+  // Dynamic entries count from the newest
+  index -= HPACK_STATIC_COUNT + 1;
+  if (index >= (unsigned long)t->count) { return -1; }
+  const HpackEntry *e = &t->entries[t->count - 1 - index];
+  *name = e->name;
+  *name_len = e->name_len;
+  *value = e->value;
+  *value_len = e->value_len;
+  return 0;
+}
+
+// Only the pseudo-headers matter to us
+static void h2_request_field(H2Request *req, const char *name, size_t name_len,
+                             const char *value, size_t value_len) {
+  if (name_len == 7 && memcmp(name, ":method", 7) == 0 && value_len < sizeof(req->method)) {
+    memcpy(req->method, value, value_len);
+    req->method[value_len] = '\0';
+  } else if (name_len == 5 && memcmp(name, ":path", 5) == 0 && value_len < sizeof(req->path)) {
+    memcpy(req->path, value, value_len);
+    req->path[value_len] = '\0';
+  }
+}
+
+static int hpack_decode(HpackTable *t, const unsigned char *p, size_t len, H2Request *req) {
+  const unsigned char *end = p + len;
+  while (p < end) {
+    unsigned char first = *p;
+    unsigned long index;
+    const char *name, *value;
+    size_t name_len, value_len;
+    if (first & 0x80) {
+      // Indexed field
+      if (hpack_read_int(&p, end, 7, &index) < 0 ||
+          hpack_lookup(t, index, &name, &name_len, &value, &value_len) < 0) {
+        return -1;
+      }
+      h2_request_field(req, name, name_len, value, value_len);
+    } else if ((first & 0xe0) == 0x20) {
+      // Dynamic table size update
+      if (hpack_read_int(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE) { return -1; }
+      t->max_size = index;
+      hpack_evict(t, index);
+    } else {
+      // Literal with incremental indexing, without indexing, or never indexed
+      int incremental = (first & 0xc0) == 0x40;
+      if (hpack_read_int(&p, end, incremental ? 6 : 4, &index) < 0) { return -1; }
+      char *new_name = NULL;
+      if (index) {
+        if (hpack_lookup(t, index, &name, &name_len, &value, &value_len) < 0) { return -1; }
+        new_name = memdup0(name, name_len);
+      } else {
+        new_name = hpack_read_string(&p, end, &name_len);
+      }
+      char *new_value = new_name ? hpack_read_string(&p, end, &value_len) : NULL;
+      if (!new_value) {
+        free(new_name);
+        return -1;
+      }
+      h2_request_field(req, new_name, name_len, new_value, value_len);
+      if (incremental) {
+        if (hpack_insert(t, new_name, name_len, new_value, value_len) < 0) { return -1; }
+      } else {
+        free(new_name);
+        free(new_value);
+      }
+    }
+  }
+  return 0;
+}
+
+// Runs a request on a new stream through the usual routes
+static void h2_request(H2Conn *c, unsigned int id, const char *method, const char *path) {
+  H2Stream *s = h2_add_stream(c, id);
+  if (!s) {
+    h2_rst_stream(c, id, H2_REFUSED_STREAM);
+    return;
+  }
+  begin_request(c->client.s_addr);
+  h2_sink = c;
+  h2_sink_stream = id;
+  int flags = strcmp(method, "HEAD") == 0 ? OPT_HEAD : 0;
+  s->head = flags & OPT_HEAD;
+  current_request.flags = flags;
+  if (debug) {
+    printf("Received HTTP/2 request: Stream=%u, Method=%s, Path=%s\n", id, method, path);
+    fflush(stdout);
+  }
+  if (!flags && strcmp(method, "GET") != 0) {
+    send_error_response(c->fd, "405 Method Not Allowed", "Method Not Allowed");
+  } else if (!*path) {
+    send_error_response(c->fd, "400 Bad Request", "Bad Request");
+  } else {
+    if (handle_request(c->fd, path, flags, c->client)) {
+      h2_sink = NULL;
+      return;
+    }
+  }
+  end_request(c->fd);
+}
+
+static int h2_headers_done(H2Conn *c, unsigned int id) {
+  H2Request req = { "", "" };
+  if (hpack_decode(&c->decoder, (unsigned char *)c->headers, c->headers_len, &req) < 0) {
+    h2_goaway(c, H2_COMPRESSION_ERROR);
+    return -1;
+  }
+  if (c->closing) { return 0; }
+  if (c->stream_count >= H2_MAX_STREAMS) {
+    h2_rst_stream(c, id, H2_REFUSED_STREAM);
+    return 0;
+  }
+  h2_request(c, id, req.method, req.path);
+  return 0;
+}
+
+static int h2_append_headers(H2Conn *c, const unsigned char *data, size_t len) {
+  if (c->headers_len + len > H2_MAX_HEADER_BLOCK ||
+      buffer_append(&c->headers, &c->headers_len, &c->headers_cap, data, len) < 0) {
+    h2_goaway(c, H2_PROTOCOL_ERROR);
+    return -1;
+  }
+  return 0;
+}
+
+static int h2_apply_settings(H2Conn *c, const unsigned char *payload, size_t len) {
+  for (size_t i = 0; i + 6 <= len; i += 6) {
+    unsigned int id = payload[i] << 8 | payload[i + 1];
+    unsigned long value = read_u32(payload + i + 2);
+    if (id == 1 && value != c->encoder_max) {
+      // SETTINGS_HEADER_TABLE_SIZE
+      c->encoder_max = value;
+      c->encoder_reset = 1;
+    } else if (id == 4) {
+      // SETTINGS_INITIAL_WINDOW_SIZE, which applies to open streams too
+      if (value > H2_MAX_WINDOW) {
+        h2_goaway(c, H2_FLOW_CONTROL_ERROR);
+        return -1;
+      }
+      for (int s = 0; s < c->stream_count; s++) {
+        c->streams[s].window += (int)value - c->initial_window;
+      }
+      c->initial_window = (int)value;
+    } else if (id == 5 && (value < H2_MAX_FRAME || value > 0xffffff)) {
+      // SETTINGS_MAX_FRAME_SIZE, we never send more than the minimum
+      h2_goaway(c, H2_PROTOCOL_ERROR);
+      return -1;
+    }
+  }
+  h2_advance_all(c);
+  return 0;
+}
+
+// Returns -1 on a connection error, after queueing GOAWAY
+static int h2_handle_frame(H2Conn *c, H2FrameType type, int flags, unsigned int id,
+                           const unsigned char *payload, size_t len) {
+  if (c->header_stream && (type != H2_CONTINUATION || id != c->header_stream)) {
+    h2_goaway(c, H2_PROTOCOL_ERROR);
+    return -1;
+  }
+  switch (type) {
+    case H2_DATA:
+      if (id == 0) {
+        h2_goaway(c, H2_PROTOCOL_ERROR);
+        return -1;
+      }
+      // Request bodies are ignored, but mustn't stall the connection
+      if (len > 0) { h2_window_update(c, 0, len); }
+      break;
+    case H2_HEADERS: {
+      size_t skip = 0;
+      size_t pad = 0;
+      if (flags & H2_FLAG_PADDED) {
+        pad = len > 0 ? payload[0] : 0;
+        skip = 1;
+      }
+      if (flags & H2_FLAG_PRIORITY) { skip += 5; }
+      if (id == 0 || !(id & 1) || id <= c->last_stream || skip + pad > len) {
+        h2_goaway(c, H2_PROTOCOL_ERROR);
+        return -1;
+      }
+      c->last_stream = id;
+      c->headers_len = 0;
+      if (h2_append_headers(c, payload + skip, len - skip - pad) < 0) { return -1; }
+      if (flags & H2_FLAG_END_HEADERS) { return h2_headers_done(c, id); }
+      c->header_stream = id;
+      break;
+    }
+    case H2_CONTINUATION:
+      if (!c->header_stream) {
+        h2_goaway(c, H2_PROTOCOL_ERROR);
+        return -1;
+      }
+      if (h2_append_headers(c, payload, len) < 0) { return -1; }
+      if (flags & H2_FLAG_END_HEADERS) {
+        c->header_stream = 0;
+        return h2_headers_done(c, id);
+      }
+      break;
+    case H2_RST_STREAM:
+      if (id == 0 || len != 4) {
+        h2_goaway(c, H2_PROTOCOL_ERROR);
+        return -1;
+      }
+      h2_cancel_stream(c, id);
+      break;
+    case H2_SETTINGS:
+      if (id != 0 || ((flags & H2_FLAG_ACK) ? len != 0 : len % 6 != 0)) {
+        h2_goaway(c, H2_FRAME_SIZE_ERROR);
+        return -1;
+      }
+      if (!(flags & H2_FLAG_ACK)) {
+        if (h2_apply_settings(c, payload, len) < 0) { return -1; }
+        h2_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+      }
+      break;
+    case H2_PUSH_PROMISE:
+      h2_goaway(c, H2_PROTOCOL_ERROR);
+      return -1;
+    case H2_PING:
+      if (id != 0 || len != 8) {
+        h2_goaway(c, H2_FRAME_SIZE_ERROR);
+        return -1;
+      }
+      if (!(flags & H2_FLAG_ACK)) { h2_frame(c, H2_PING, H2_FLAG_ACK, 0, payload, len); }
+      break;
+    case H2_GOAWAY:
+      c->closing = 1;
+      break;
+    case H2_WINDOW_UPDATE: {
+      if (len != 4) {
+        h2_goaway(c, H2_FRAME_SIZE_ERROR);
+        return -1;
+      }
+      long long increment = read_u32(payload) & 0x7fffffff;
+      if (id == 0) {
+        if (c->window + increment > H2_MAX_WINDOW) {
+          h2_goaway(c, H2_FLOW_CONTROL_ERROR);
+          return -1;
+        }
+        c->window += increment;
+        h2_advance_all(c);
+      } else {
+        H2Stream *s = h2_find_stream(c, id);
+        if (s && s->window + increment > H2_MAX_WINDOW) {
+          h2_rst_stream(c, id, H2_FLOW_CONTROL_ERROR);
+          h2_cancel_stream(c, id);
+        } else if (s) {
+          s->window += increment;
+          h2_advance(c, s);
+        }
+      }
+      break;
+    }
+    default:
+      // PRIORITY and unknown frame types are ignored
+      break;
+  }
+  return 0;
+}
+
+// Handles the complete frames in the input buffer
+static int h2_process(H2Conn *c) {
+  size_t off = 0;
+  if (!c->preface_done) {
+    size_t n = c->in_len < H2_PREFACE_LEN ? c->in_len : H2_PREFACE_LEN;
+    if (memcmp(c->in, H2_PREFACE, n) != 0) { return -1; }
+    if (n < H2_PREFACE_LEN) { return 0; }
+    c->preface_done = 1;
+    off = H2_PREFACE_LEN;
+  }
+  int rc = 0;
+  while (rc == 0 && c->in_len - off >= H2_FRAME_HEADER) {
+    const unsigned char *h = c->in + off;
+    size_t len = (size_t)h[0] << 16 | h[1] << 8 | h[2];
+    if (len > H2_MAX_FRAME) {
+      h2_goaway(c, H2_FRAME_SIZE_ERROR);
+      return -1;
+    }
+    if (c->in_len - off < H2_FRAME_HEADER + len) { break; }
+    rc = h2_handle_frame(c, h[3], h[4], read_u32(h + 5) & 0x7fffffff, h + H2_FRAME_HEADER, len);
+    off += H2_FRAME_HEADER + len;
+  }
+  memmove(c->in, c->in + off, c->in_len - off);
+  c->in_len -= off;
+  return rc;
+}
+
+static void h2_write(H2Conn *c) {
+  size_t sent = 0;
+  while (!c->dead && sent < c->out_len) {
+    ssize_t n = send(c->fd, c->out + sent, c->out_len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) { c->dead = 1; }
+      break;
+    }
+    sent += n;
+  }
+  if (c->dead) { sent = c->out_len; }
+  memmove(c->out, c->out + sent, c->out_len - sent);
+  c->out_len -= sent;
+}
+
+// Parks a connection that opened with the HTTP/2 preface or was upgraded
+static H2Conn *h2_start(int client_socket, struct in_addr client) {
+  H2Conn *c = calloc(1, sizeof(H2Conn));
+  if (!c) {
+    perror("calloc failed");
+    return NULL;
+  }
+  c->fd = client_socket;
+  c->client = client;
+  c->window = H2_DEFAULT_WINDOW;
+  c->initial_window = H2_DEFAULT_WINDOW;
+  c->encoder_max = HPACK_TABLE_SIZE;
+  c->decoder.max_size = HPACK_TABLE_SIZE;
+  c->deadline = now_ms() + H2_IDLE_TIMEOUT * 1000LL;
+  if (!park_connection(client_socket, PARK_H2, BULK_NONE, 0, 0, c->deadline)) {
+    free(c);
+    return NULL;
+  }
+  parked[parked_count - 1].h2 = c;
+  h2_connection_count++;
+  // Only the stream limit differs from the defaults
+  unsigned char settings[6] = { 0, 3, 0, 0, 0, H2_MAX_STREAMS };
+  h2_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+  return c;
+}
+
+// Feeds bytes already read from the socket
+static void h2_input(H2Conn *c, const char *data, size_t len) {
+  memcpy(c->in + c->in_len, data, len);
+  c->in_len += len;
+  if (h2_process(c) < 0) { c->closing = 1; }
+}
+
+// Finds a request header among the lines between p and end
+static const char *find_header(const char *p, const char *end, const char *name, size_t *len) {
+  size_t name_len = strlen(name);
+  while ((p = memchr(p, '\n', end - p)) && ++p < end) {
+    if ((size_t)(end - p) <= name_len || strncasecmp(p, name, name_len) != 0 || p[name_len] != ':') {
+      continue;
+    }
+    const char *value = p + name_len + 1;
+    while (value < end && (*value == ' ' || *value == '\t')) { value++; }
+    const char *eol = value;
+    while (eol < end && *eol != '\r' && *eol != '\n') { eol++; }
+    *len = eol - value;
+    return value;
+  }
+  return NULL;
+}
+
+// Padding is optional, as HTTP2-Settings leaves it out
+static int base64url_decode(const char *in, size_t len, unsigned char *out, size_t out_size) {
+  size_t n = 0;
+  unsigned long bits = 0;
+  int bit_count = 0;
+  for (size_t i = 0; i < len && in[i] != '='; i++) {
+    const char *digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    const char *digit = in[i] ? strchr(digits, in[i]) : NULL;
+    if (!digit) { return -1; }
+    bits = bits << 6 | (digit - digits);
+    bit_count += 6;
+    if (bit_count >= 8) {
+      if (n == out_size) { return -1; }
+      bit_count -= 8;
+      out[n++] = (bits >> bit_count) & 0xff;
+    }
+  }
+  return (int)n;
+}
+
+// Switches an HTTP/1.1 request carrying Upgrade: h2c over to HTTP/2 and
+// answers it on stream 1. Returns 0, to carry on with HTTP/1.1, when it
+// doesn't ask for that or its HTTP2-Settings are invalid.
+static int h2_upgrade(int client_socket, struct in_addr client, const char *request, size_t len,
+                      const char *method, const char *path) {
+  const char *end = request + len;
+  size_t upgrade_len, settings_len;
+  const char *upgrade = find_header(request, end, "Upgrade", &upgrade_len);
+  const char *settings = find_header(request, end, "HTTP2-Settings", &settings_len);
+  const char *head_end = memmem(request, len, "\r\n\r\n", 4);
+  if (!upgrade || !memmem(upgrade, upgrade_len, "h2c", 3) || !settings || !head_end) { return 0; }
+  unsigned char payload[H2_MAX_SETTINGS * 6];
+  int settings_size = base64url_decode(settings, settings_len, payload, sizeof(payload));
+  if (settings_size < 0 || settings_size % 6 != 0) { return 0; }
+  static const char switching[] =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Connection: Upgrade\r\n"
+    "Upgrade: h2c\r\n"
+    "\r\n";
+  send_all(client_socket, switching, sizeof(switching) - 1);
+  H2Conn *c = h2_start(client_socket, client);
+  if (!c) {
+    close(client_socket);
+    return 1;
+  }
+  if (h2_apply_settings(c, payload, settings_size) == 0) {
+    c->last_stream = 1;
+    h2_request(c, 1, method, path);
+  }
+  // The client preface may have come along with the request
+  h2_input(c, head_end + 4, end - (head_end + 4));
+  return 1;
+}
+
+// Ends the connection's long-poll and /events streams, gracefully on
+// handover by answering long-polls 304
+static void h2_end_parked_streams(H2Conn *c, int graceful) {
+  for (int i = parked_count - 1; i >= 0; i--) {
+    if (i >= parked_count || parked[i].h2 != c || parked[i].type == PARK_H2) { continue; }
+    Parked p = parked[i];
+    unpark_connection(i);
+    resume_request(&p);
+    if (graceful && p.type == PARK_WAIT) { send_not_modified(p.fd); }
+    end_request(p.fd);
+  }
+}
+
+// On handover: parked streams are ended, GOAWAY keeps new ones away and
+// the others may finish, flow control permitting, until the deadline
+static void h2_drain(H2Conn *c, long long deadline) {
+  if (c->draining) { return; }
+  h2_end_parked_streams(c, 1);
+  h2_goaway(c, H2_NO_ERROR);
+  c->draining = 1;
+  c->deadline = deadline;
+  h2_write(c);
+}
+
+// Ends the connection's parked streams and then the connection. A graceful
+// close, on handover, answers long-polls 304 and says GOAWAY first.
+static void h2_close(H2Conn *c, int graceful) {
+  h2_end_parked_streams(c, graceful);
+  if (graceful && !c->draining) {
+    h2_goaway(c, H2_NO_ERROR);
+    h2_write(c);
+  }
+  for (int i = parked_count - 1; i >= 0; i--) {
+    if (parked[i].h2 == c && parked[i].type == PARK_H2) {
+      unpark_connection(i);
+      break;
+    }
+  }
+  h2_connection_count--;
+  close(c->fd);
+  for (int i = 0; i < c->stream_count; i++) { free(c->streams[i].pending); }
+  for (int i = 0; i < c->indexed_count; i++) { free(c->indexed_value[i]); }
+  hpack_evict(&c->decoder, 0);
+  free(c->decoder.entries);
+  free(c->streams);
+  free(c->headers);
+  free(c->out);
+  free(c);
+}
+
+// Reads and handles what the peer sent, then writes out what is queued
+static void h2_on_ready(H2Conn *c, short revents) {
+  // A bounded number of reads, so one busy connection can't starve the rest.
+  // A draining connection still needs the peer's WINDOW_UPDATEs.
+  for (int reads = 0; reads < 16 && !c->dead && (!c->closing || c->draining) &&
+                      (revents & (POLLIN | POLLHUP | POLLERR)); reads++) {
+    ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) { break; }
+    if (n <= 0) {
+      c->dead = 1;
+      break;
+    }
+    c->in_len += n;
+    if (!c->draining) { c->deadline = now_ms() + H2_IDLE_TIMEOUT * 1000LL; }
+    if (h2_process(c) < 0) {
+      c->closing = 1;
+      c->draining = 0;
+    }
+  }
+  h2_write(c);
+}
+
+// Before each poll(): flushes output, closes finished or idle connections
+// and asks for POLLOUT where output is still queued
+static void h2_service(long long now) {
+  for (int i = parked_count - 1; i >= 0; i--) {
+    // Closing a connection removes its streams too
+    if (i >= parked_count || parked[i].type != PARK_H2) { continue; }
+    H2Conn *c = parked[i].h2;
+    int waiting = 0;
+    for (int s = 0; s < c->stream_count; s++) { waiting |= c->streams[s].parked; }
+    if (waiting) {
+      // Long-polls and /events keep the connection open
+      c->deadline = now + H2_IDLE_TIMEOUT * 1000LL;
+    } else if (now >= c->deadline && c->closing) {
+      c->dead = 1; // Not reading what we already said
+    } else if (now >= c->deadline) {
+      h2_goaway(c, H2_NO_ERROR);
+      c->deadline = now + H2_IDLE_TIMEOUT * 1000LL;
+    }
+    h2_write(c);
+    int busy = 0;
+    for (int s = 0; s < c->stream_count && !busy; s++) {
+      busy = !c->streams[s].parked;
+    }
+    if (c->dead || (c->closing && c->out_len == 0 && !busy)) {
+      h2_close(c, 0);
+      continue;
+    }
+    parked[i].deadline = c->deadline;
+    poll_fds[POLL_FIXED + i].events = POLLIN | (c->out_len > 0 ? POLLOUT : 0);
+  }
+}
+
+// Writes /events data to a parked subscriber without blocking, -1 if it
+// couldn't take all of it
+static int park_send(const Parked *p, const char *data, size_t len) {
+  if (p->h2) { return h2_stream_send(p->h2, p->stream, data, len); }
+  return send(p->fd, data, len, MSG_DONTWAIT) == (ssize_t)len ? 0 : -1;
+}
+
+int route_homepage(int client_socket, const RequestOptions *opts) {
+  return handle_bulk_request(client_socket, BULK_HTML, opts);
+}
+
+int route_icon(int client_socket, const RequestOptions *opts) {
+  send_binary_response(client_socket, "image/png", icon_png, (size_t)icon_png_len,
+                       opts->flags & OPT_HEAD);
+  return 0;
+}
+
+int route_json(int client_socket, const RequestOptions *opts) {
+  return handle_bulk_request(client_socket, BULK_JSON, opts);
+}
+
+int route_yaml(int client_socket, const RequestOptions *opts) {
+  return handle_bulk_request(client_socket, BULK_YAML, opts);
+}
+
+int route_sh(int client_socket, const RequestOptions *opts) {
+  return handle_bulk_request(client_socket, BULK_SH, opts);
+}
+
+int route_sys(int client_socket, const RequestOptions *opts) {
+  serve_sys(client_socket, opts->flags);
+  return 0;
+}
+
+int route_var(int client_socket, const RequestOptions *opts) {
+  handle_var_request(client_socket, opts->rest, opts->flags);
+  return 0;
+}
+
+int route_events(int client_socket, const RequestOptions *opts) {
+  serve_events(client_socket, opts->flags);
+  if (opts->flags & OPT_HEAD) { return 0; }
+  return park_connection(client_socket, PARK_EVENTS, BULK_NONE, 0, env_version,
+                         now_ms() + EVENTS_HEARTBEAT * 1000LL);
+}
+
+int handle_bulk_request(int client_socket, BulkFormat format, const RequestOptions *opts) {
+  if ((opts->flags & OPT_WAIT) && env_version <= opts->wait) {
+    if (debug) {
+      printf("Parking client (socket %d) until version > %lu\n", client_socket, opts->wait);
+      fflush(stdout);
+    }
+    return park_connection(client_socket, PARK_WAIT, format, opts->flags, opts->wait,
+                           now_ms() + opts->timeout * 1000LL);
+  }
+  serve_bulk(client_socket, format, opts->flags);
+  return 0;
+}
+
+int route_metrics(int client_socket, const RequestOptions *opts) {
+  char metrics[BUFFER_SIZE * 8];
+  size_t len = 0;
+#define METRIC(...) \
+  if (len < sizeof(metrics)) { len += snprintf(metrics + len, sizeof(metrics) - len, __VA_ARGS__); }
+  METRIC("# TYPE envhttpd_env_version gauge\nenvhttpd_env_version %lu\n", env_version);
+  METRIC("# TYPE envhttpd_parked_connections gauge\nenvhttpd_parked_connections %d\n", parked_count);
+  METRIC("# TYPE envhttpd_http2_connections gauge\nenvhttpd_http2_connections %d\n", h2_connection_count);
+  METRIC("# TYPE envhttpd_limiter_clients gauge\nenvhttpd_limiter_clients %d\n", client_count);
+  METRIC("# TYPE envhttpd_limiter_evicted_total counter\nenvhttpd_limiter_evicted_total %lu\n",
+         limiter_stats.evicted);
+  METRIC("# TYPE envhttpd_limiter_requests_total counter\n");
+  for (int i = 0; i < ROUTE_SLOTS; i++) {
+    if (!routes[i].handler) { continue; }
+    METRIC("envhttpd_limiter_requests_total{route=\"%s\",decision=\"allowed\"} %lu\n",
+           routes[i].path, limiter_stats.allowed[i]);
+    METRIC("envhttpd_limiter_requests_total{route=\"%s\",decision=\"limited\"} %lu\n",
+           routes[i].path, limiter_stats.limited[i]);
+  }
+  METRIC("envhttpd_limiter_requests_total{decision=\"shed\"} %lu\n", limiter_stats.shed);
+  METRIC("# TYPE envhttpd_env_source_reads_total counter\n");
+  METRIC("envhttpd_env_source_reads_total{outcome=\"unchanged\"} %lu\n", source_stats.unchanged);
+  METRIC("envhttpd_env_source_reads_total{outcome=\"parsed\"} %lu\n", source_stats.parsed);
+  METRIC("envhttpd_env_source_reads_total{outcome=\"failed\"} %lu\n", source_stats.failed);
+  METRIC("# TYPE envhttpd_access_log_records_total counter\n");
+  METRIC("envhttpd_access_log_records_total{outcome=\"written\"} %lu\n",
+         atomic_load_explicit(&access_written, memory_order_relaxed));
+  METRIC("envhttpd_access_log_records_total{outcome=\"dropped\"} %lu\n",
+         atomic_load_explicit(&access_dropped, memory_order_relaxed));
+#undef METRIC
+  if (len >= sizeof(metrics)) {
+    send_error_response(client_socket, "500 Internal Server Error", "Internal Server Error");
+    return 0;
+  }
+  send_response(client_socket, "text/plain", metrics, opts->flags & OPT_HEAD);
+  return 0;
+}
+
+#ifdef ENVHTTPD_PROFILE
+// Prints count, mean, quantiles and max, dividing values by scale
+static void print_histogram(FILE *out, const Histogram *h, double scale) {
+  fprintf(out, "{\"count\":%llu,\"mean\":%.3f", h->count,
+          h->count ? h->sum / scale / h->count : 0.0);
+  const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  const char *names[] = { "p50", "p90", "p99", "p999" };
+  for (int i = 0; i < 4; i++) {
+    fprintf(out, ",\"%s\":%.3f", names[i], hist_quantile(h, quantiles[i]) / scale);
+  }
+  fprintf(out, ",\"max\":%.3f}", h->max / scale);
+}
+
+static double prof_ticks_per_us(void) {
+  double elapsed_us = now_us() - prof_epoch_ns / 1000.0;
+  if (elapsed_us <= 0) { return 1000.0; }
+  return (prof_ticks() - prof_epoch_ticks) / elapsed_us;
+}
+
+// Histograms of every phase in microseconds, and allocations per request
+static char *profile_json(void) {
+  char *json = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&json, &size);
+  if (!out) { return NULL; }
+  double ticks_per_us = prof_ticks_per_us();
+  fprintf(out, "{\"ticks_per_us\":%.3f,\"requests\":%lu,\"phases_us\":{", ticks_per_us, prof_requests);
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    fprintf(out, "%s\"%s\":", i ? "," : "", phase_names[i]);
+    print_histogram(out, &prof_phases[i], ticks_per_us);
+  }
+  fprintf(out, "},\"allocations\":{\"total\":%lu,\"total_bytes\":%lu,\"per_request\":",
+          prof_total_allocs, prof_total_alloc_bytes);
+  print_histogram(out, &prof_allocs, 1);
+  fprintf(out, ",\"bytes_per_request\":");
+  print_histogram(out, &prof_alloc_bytes, 1);
+  fprintf(out, "}}\n");
+  return fclose(out) == 0 ? json : NULL;
+}
+
+// The sampled requests in Chrome trace event format, one row per request
+static char *profile_trace_json(void) {
+  char *json = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&json, &size);
+  if (!out) { return NULL; }
+  double ticks_per_us = prof_ticks_per_us();
+  unsigned long first = prof_trace_count > TRACE_KEEP ? prof_trace_count - TRACE_KEEP : 0;
+  int comma = 0;
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (unsigned long n = first; n < prof_trace_count; n++) {
+    const Trace *t = &prof_traces[n % TRACE_KEEP];
+    for (int i = 0; i < t->events; i++) {
+      const TraceEvent *e = &t->event[i];
+      fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"envhttpd\",\"ph\":\"X\",\"pid\":%d,\"tid\":%lu,"
+              "\"ts\":%.3f,\"dur\":%.3f", comma++ ? "," : "", phase_names[e->phase], (int)getpid(),
+              t->seq, (e->start - prof_epoch_ticks) / ticks_per_us, (e->end - e->start) / ticks_per_us);
+      if (e->phase == PHASE_REQUEST) {
+        fprintf(out, ",\"args\":{\"route\":\"%s\",\"status\":%d,\"allocations\":%lu,\"allocated_bytes\":%lu}",
+                t->route < ROUTE_SLOTS ? routes[t->route].path : "", t->status, t->allocs, t->alloc_bytes);
+      }
+      fprintf(out, "}");
+    }
+  }
+  fprintf(out, "]}\n");
+  return fclose(out) == 0 ? json : NULL;
+}
+#endif
+
+// /debug/profile, only when built with PROFILE=1 and started with -P
+int route_debug(int client_socket, const RequestOptions *opts) {
+#ifdef ENVHTTPD_PROFILE
+  if (profiling && strcmp(opts->rest, "profile") == 0) {
+    char *body = (opts->flags & OPT_TRACE) ? profile_trace_json() : profile_json();
+    if (!body) {
+      send_error_response(client_socket, "500 Internal Server Error", "Internal Server Error");
+      return 0;
+    }
+    send_response(client_socket, "application/json", body, opts->flags & OPT_HEAD);
+    free(body);
+    return 0;
+  }
+#endif
+  (void)opts;
+  send_error_response(client_socket, "404 Not Found", "Not Found");
+  return 0;
+}
+
+// Parses RATE[:BURST] (-r) or ROUTE=RATE[:BURST] (-R) into rate_limits
+int add_rate_limit(const char *spec, int per_route) {
+  int slot = ROUTE_SLOTS;
+  if (per_route) {
+    const char *eq = strchr(spec, '=');
+    if (!eq || eq == spec) { return -1; }
+    size_t len = eq - spec;
+    slot = ROUTE_HASH(spec, len);
+    if (!routes[slot].handler || routes[slot].len != len ||
+        memcmp(routes[slot].path, spec, len) != 0) {
+      return -1;
+    }
+    spec = eq + 1;
+  }
+  char *end;
+  double rate = strtod(spec, &end);
+  double burst = rate < 1 ? 1 : rate;
+  if (*end == ':') { burst = strtod(end + 1, &end); }
+  if (*end || rate <= 0 || burst < 1) { return -1; }
+  rate_limits[slot].rate = rate;
+  rate_limits[slot].burst = burst;
+  rate_limiting = 1;
+  return 0;
+}
+
+static void lru_unlink(int i) {
+  ClientBucket *b = &client_buckets[i];
+  if (b->lru_prev >= 0) { client_buckets[b->lru_prev].lru_next = b->lru_next; } else { lru_head = b->lru_next; }
+  if (b->lru_next >= 0) { client_buckets[b->lru_next].lru_prev = b->lru_prev; } else { lru_tail = b->lru_prev; }
+}
+
+static void lru_push_front(int i) {
+  ClientBucket *b = &client_buckets[i];
+  b->lru_prev = -1;
+  b->lru_next = lru_head;
+  if (lru_head >= 0) { client_buckets[lru_head].lru_prev = i; }
+  lru_head = i;
+  if (lru_tail < 0) { lru_tail = i; }
+}
+
+static unsigned client_hash_of(in_addr_t addr) {
+  return ((uint32_t)addr * 2654435761u) % LIMIT_HASH_SIZE;
+}
+
+// Finds or creates the client's buckets, evicting the least recently seen
+// client once the table is full
+static ClientBucket *client_bucket(in_addr_t addr, long long now) {
+  unsigned h = client_hash_of(addr);
+  for (int i = client_hash[h]; i >= 0; i = client_buckets[i].hash_next) {
+    if (client_buckets[i].addr == addr) {
+      lru_unlink(i);
+      lru_push_front(i);
+      return &client_buckets[i];
+    }
+  }
+  int i;
+  if (client_count < LIMIT_TABLE_SIZE) {
+    i = client_count++;
+  } else {
+    i = lru_tail;
+    lru_unlink(i);
+    int *link = &client_hash[client_hash_of(client_buckets[i].addr)];
+    while (*link != i) { link = &client_buckets[*link].hash_next; }
+    *link = client_buckets[i].hash_next;
+    limiter_stats.evicted++;
   }
-  close(server_fd);
-  return 0;
+  ClientBucket *b = &client_buckets[i];
+  b->addr = addr;
+  b->hash_next = client_hash[h];
+  client_hash[h] = i;
+  b->refilled = now;
+  for (int j = 0; j <= ROUTE_SLOTS; j++) { b->tokens[j] = rate_limits[j].burst; }
+  lru_push_front(i);
+  return b;
 }
 
-void handle_client(int client_socket) {
-  if (debug) {
-    printf("Handling new client (socket %d).\n", client_socket);
-    fflush(stdout);
+// Takes a token from the client's default and route buckets. Returns 0 if
+// admitted, otherwise the seconds to wait before retrying.
+int limiter_check(struct in_addr client, int slot) {
+  if (!rate_limiting) {
+    limiter_stats.allowed[slot]++;
+    return 0;
   }
-  char buffer[BUFFER_SIZE];
-  ssize_t bytes_read = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-  if (bytes_read < 0) {
-    perror("recv failed");
-    close(client_socket);
-    return;
+  if (!client_buckets) {
+    client_buckets = malloc(LIMIT_TABLE_SIZE * sizeof(ClientBucket));
+    client_hash = malloc(LIMIT_HASH_SIZE * sizeof(int));
+    if (!client_buckets || !client_hash) {
+      perror("malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < LIMIT_HASH_SIZE; i++) { client_hash[i] = -1; }
   }
-  if (bytes_read == 0) {
-    close(client_socket);
-    return;
+  long long now = now_us();
+  ClientBucket *b = client_bucket(client.s_addr, now);
+  double elapsed = (now - b->refilled) / 1e6;
+  b->refilled = now;
+  int buckets[2] = { ROUTE_SLOTS, slot };
+  double wait = 0;
+  for (int i = 0; i < 2; i++) {
+    RateLimit *limit = &rate_limits[buckets[i]];
+    if (limit->rate <= 0) { continue; }
+    float *tokens = &b->tokens[buckets[i]];
+    *tokens += elapsed * limit->rate;
+    if (*tokens > limit->burst) { *tokens = limit->burst; }
+    if (*tokens < 1 && (1 - *tokens) / limit->rate > wait) {
+      wait = (1 - *tokens) / limit->rate;
+    }
   }
-  buffer[bytes_read] = '\0';
+  if (wait > 0) {
+    limiter_stats.limited[slot]++;
+    int retry_after = (int)wait;
+    return retry_after < wait ? retry_after + 1 : retry_after;
+  }
+  for (int i = 0; i < 2; i++) {
+    if (rate_limits[buckets[i]].rate > 0) { b->tokens[buckets[i]] -= 1; }
+  }
+  limiter_stats.allowed[slot]++;
+  return 0;
+}
 
-  char *line_end = strpbrk(buffer, "\r\n");
-  if (!line_end) {
-    send_error_response(client_socket, "400 Bad Request",
-                        "Request line too long or invalid");
-    close(client_socket);
-    return;
+// Renders into response_cache once per version, so HEAD and repeat GETs
+// only cost a send()
+void serve_bulk(int client_socket, BulkFormat format, int flags) {
+  int variant = (format == BULK_JSON && (flags & OPT_PRETTY)) ||
+                (format == BULK_SH && (flags & OPT_EXPORT));
+  CachedResponse *cached = &response_cache[format][variant];
+  if (cached->version != env_version) {
+    PROF_BEGIN(RENDER);
+    const char *content_type = "text/plain";
+    char *body = NULL;
+    switch (format) {
+      case BULK_HTML:
+        content_type = "text/html";
+        body = render_homepage();
+        break;
+      case BULK_JSON:
+        content_type = debug ? "text/json" : "application/json";
+        body = render_json(variant);
+        break;
+      case BULK_YAML:
+        content_type = debug ? "text/yaml" : "application/yaml";
+        body = render_yaml();
+        break;
+      case BULK_SH:
+        body = render_shell(variant);
+        break;
+      default:
+        break;
+    }
+    size_t header_len;
+    char *response = body ? build_response(content_type, 1, body, strlen(body), &header_len) : NULL;
+    free(body);
+    PROF_END(RENDER);
+    if (!response) {
+      send_error_response(client_socket, "500 Internal Server Error", "Internal Server Error");
+      return;
+    }
+    free(cached->response);
+    cached->response = response;
+    cached->header_len = header_len;
+    cached->len = strlen(response);
+    cached->version = env_version;
   }
-  *line_end = '\0';
+  current_request.status = 200;
+  send_all(client_socket, cached->response,
+           (flags & OPT_HEAD) ? cached->header_len : cached->len);
+}
 
-  char method[MAX_METHOD_LEN + 1];
-  char path[MAX_PATH_LEN + 1];
-  int n = sscanf(buffer, "%7s %1023s", method, path);
-  if (n != 2) {
-    send_error_response(client_socket, "400 Bad Request", "Bad Request");
-    close(client_socket);
-    return;
+void serve_events(int client_socket, int flags) {
+  char buffer[BUFFER_SIZE];
+  int len = snprintf(buffer, sizeof(buffer),
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: text/event-stream; charset=utf-8\r\n"
+                     "Cache-Control: no-cache\r\n"
+                     "Hostname: %s\r\n"
+                     "Env-Version: %lu\r\n"
+                     "\r\n"
+                     "id: %lu\n"
+                     "event: version\n"
+                     "data: {\"version\":%lu}\n\n",
+                     hostname, env_version, env_version, env_version);
+  if (flags & OPT_HEAD) {
+    len = strstr(buffer, "\r\n\r\n") + 4 - buffer;
   }
-  if (strcmp(method, "GET") != 0) {
-    send_error_response(client_socket, "405 Method Not Allowed",
-                        "Method Not Allowed");
-    close(client_socket);
-    return;
+  current_request.status = 200;
+  send_all(client_socket, buffer, len);
+}
+
+void send_not_modified(int client_socket) {
+  char buffer[BUFFER_SIZE];
+  int len = snprintf(buffer, sizeof(buffer),
+                     "HTTP/1.1 304 Not Modified\r\n"
+                     "Hostname: %s\r\n"
+                     "Env-Version: %lu\r\n"
+                     "\r\n",
+                     hostname, env_version);
+  current_request.status = 304;
+  send_all(client_socket, buffer, len);
+}
+
+// The request never arrived, so it may have been a HEAD and there's no body
+void send_request_timeout(int client_socket) {
+  static const char timeout[] =
+    "HTTP/1.1 408 Request Timeout\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+  current_request.status = 408;
+  send_all(client_socket, timeout, sizeof(timeout) - 1);
+}
+
+// Returns 1 if the connection is now owned by the parked table
+int park_connection(int client_socket, ParkType type, BulkFormat format, int flags,
+                    unsigned long version, long long deadline) {
+  if (parked_count == parked_cap) {
+    int cap = parked_cap * 2;
+    Parked *new_parked = realloc(parked, cap * sizeof(Parked));
+    if (!new_parked) {
+      perror("realloc failed");
+      return 0;
+    }
+    parked = new_parked;
+    struct pollfd *new_fds = realloc(poll_fds, (POLL_FIXED + cap) * sizeof(struct pollfd));
+    if (!new_fds) {
+      perror("realloc failed");
+      return 0;
+    }
+    poll_fds = new_fds;
+    parked_cap = cap;
   }
-  if (debug) {
-    printf("Received request: Method=%s, Path=%s\n", method, path);
-    fflush(stdout);
+  Parked *p = &parked[parked_count];
+  p->fd = client_socket;
+  p->type = type;
+  p->format = format;
+  p->flags = flags;
+  p->version = version;
+  p->deadline = deadline;
+  p->route = current_request.route;
+  p->addr = current_request.addr;
+  p->bytes = current_request.bytes;
+  p->started = current_request.started;
+  p->h2 = h2_sink;
+  p->stream = h2_sink ? h2_sink_stream : 0;
+  // Streams are read through their connection's entry
+  struct pollfd *pfd = &poll_fds[POLL_FIXED + parked_count];
+  pfd->fd = h2_sink ? -1 : client_socket;
+  pfd->events = POLLIN;
+  pfd->revents = 0;
+  parked_count++;
+  if (type == PARK_READ || type == PARK_H2) {
+    PROF_REQUEST_CANCEL();
+  } else {
+    PROF_REQUEST_END(0);
   }
-  handle_get_request(client_socket, path);
-  close(client_socket);
-}
-
-void handle_get_request(int client_socket, const char *path) {
-  if (strcmp(path, "/") == 0) {
-    serve_homepage(client_socket);
-  } else if (strcmp(path, "/icon.png") == 0) {
-    send_binary_response(client_socket, "image/png", icon_png, (size_t)icon_png_len);
-  } else if (strncmp(path, "/var/", 5) == 0) {
-    handle_var_request(client_socket, path + 5);
-  } else if (strcmp(path, "/json") == 0 || strcmp(path, "/json?pretty") == 0) {
-    serve_json(client_socket, strcmp(path, "/json?pretty") == 0);
-  } else if (strcmp(path, "/yaml") == 0) {
-    serve_yaml(client_socket);
-  } else if (strcmp(path, "/sh") == 0 || strcmp(path, "/sh?export") == 0) {
-    serve_shell(client_socket, strcmp(path, "/sh?export") == 0);
-  } else if (strcmp(path, "/sys") == 0) {
-    serve_sys(client_socket);
+  if (h2_sink) {
+    h2_park_stream();
   } else {
-    send_error_response(client_socket, "404 Not Found", "Not Found");
+    parked_sockets++;
   }
+  return 1;
 }
 
-void handle_var_request(int client_socket, const char *var_name) {
-  char var_buf[MAX_VAR_NAME_LEN + 1];
-  size_t len = 0;
-  const char *p = var_name;
-  while (len < MAX_VAR_NAME_LEN && *p && *p != '?') {
-    var_buf[len++] = *p++;
+// Removes a parked entry without closing it; order is not preserved
+void unpark_connection(int index) {
+  if (!parked[index].h2 || parked[index].type == PARK_H2) { parked_sockets--; }
+  parked_count--;
+  if (index != parked_count) {
+    parked[index] = parked[parked_count];
+    poll_fds[POLL_FIXED + index] = poll_fds[POLL_FIXED + parked_count];
   }
-  var_buf[len] = '\0';
-  if (len == MAX_VAR_NAME_LEN && *p && *p != '?') {
-    send_error_response(client_socket, "400 Bad Request", "Bad Request");
-    return;
+}
+
+// Answers long-polls and notifies /events subscribers of a new version
+void wake_parked() {
+  char event[BUFFER_SIZE];
+  char *message = event;
+  int len = snprintf(event, sizeof(event), "id: %lu\nevent: change\ndata: %s\n\n",
+                     env_version, last_change ? last_change : "{}");
+  if (len >= (int)sizeof(event)) {
+    if (asprintf(&message, "id: %lu\nevent: change\ndata: %s\n\n",
+                 env_version, last_change ? last_change : "{}") == -1) {
+      perror("asprintf failed");
+      return;
+    }
+  }
+  for (int i = parked_count - 1; i >= 0; i--) {
+    Parked p = parked[i];
+    if (p.type == PARK_WAIT && env_version > p.version) {
+      unpark_connection(i);
+      resume_request(&p);
+      serve_bulk(p.fd, p.format, p.flags);
+      end_request(p.fd);
+    } else if (p.type == PARK_EVENTS) {
+      // Slow subscribers are dropped rather than buffered for
+      if (park_send(&p, message, len) < 0) {
+        unpark_connection(i);
+        resume_request(&p);
+        end_request(p.fd);
+      } else {
+        parked[i].version = env_version;
+        parked[i].bytes += len;
+      }
+    }
+  }
+  if (message != event) { free(message); }
+}
+
+// Times out requests that never arrived and long-polls, and sends
+// heartbeats to idle /events subscribers
+void expire_parked(long long now) {
+  for (int i = parked_count - 1; i >= 0; i--) {
+    Parked *p = &parked[i];
+    if (p->deadline > now || p->type == PARK_H2) { continue; }
+    if (p->type != PARK_EVENTS || park_send(p, ":\n\n", 3) < 0) {
+      Parked done = *p;
+      unpark_connection(i);
+      resume_request(&done);
+      if (done.type == PARK_WAIT) { send_not_modified(done.fd); }
+      if (done.type == PARK_READ) { send_request_timeout(done.fd); }
+      end_request(done.fd);
+    } else {
+      p->deadline = now + EVENTS_HEARTBEAT * 1000LL;
+      p->bytes += 3;
+    }
   }
-  if (!is_valid_var_name(var_buf)) {
+}
+
+void handle_var_request(int client_socket, const char *var_name, int flags) {
+  if (strlen(var_name) > MAX_VAR_NAME_LEN || !is_valid_var_name(var_name)) {
     send_error_response(client_socket, "400 Bad Request", "Bad Request");
     return;
   }
   if (debug) {
-    printf("Fetching environment variable: %s\n", var_buf);
+    printf("Fetching environment variable: %s\n", var_name);
   }
-  char *value = get_env_var_value(var_buf);
+  char *value = get_env_var_value(var_name);
   if (value) {
-    send_response(client_socket, "text/plain", value);
+    send_response(client_socket, "text/plain", value, flags & OPT_HEAD);
   } else {
     send_error_response(client_socket, "404 Not Found", "Variable Not Found");
   }
 }
 
-void serve_homepage(int client_socket) {
+char *render_homepage() {
   char *title;
   if (asprintf(&title, "%s - envhttpd", hostname) == -1) {
     perror("asprintf failed");
-    close(client_socket);
-    return;
+    return NULL;
   }
 
   char *table_rows = strdup("");
   if (!table_rows) {
     perror("strdup failed");
     free(title);
-    close(client_socket);
-    return;
+    return NULL;
   }
   for (int i = 0; i < env_var_count; i++) {
     char *escaped_key = escape_html(env_vars[i].key);
@@ -360,8 +3368,7 @@ void serve_homepage(int client_socket) {
       free(table_rows);
       free(escaped_key);
       free(escaped_value);
-      close(client_socket);
-      return;
+      return NULL;
     }
 
     char *url_encoded_key = escape_url(env_vars[i].key);
@@ -371,8 +3378,7 @@ void serve_homepage(int client_socket) {
       free(table_rows);
       free(escaped_key);
       free(escaped_value);
-      close(client_socket);
-      return;
+      return NULL;
     }
 
     char *new_table_rows;
@@ -384,8 +3390,7 @@ void serve_homepage(int client_socket) {
       free(escaped_key);
       free(escaped_value);
       free(url_encoded_key);
-      close(client_socket);
-      return;
+      return NULL;
     }
 
     free(table_rows);
@@ -400,32 +3405,27 @@ void serve_homepage(int client_socket) {
     perror("asprintf failed");
     free(title);
     free(table_rows);
-    close(client_socket);
-    return;
+    return NULL;
   }
 
   free(title);
   free(table_rows);
 
-  send_response(client_socket, "text/html", html);
-  free(html);
+  return html;
 }
 
-void serve_json(int client_socket, int pretty) {
-  char *content_type = debug ? "text/json" : "application/json";
+char *render_json(int pretty) {
   char *json = pretty ? strdup("{\n") : strdup("{");
   if (!json) {
     perror("strdup failed");
-    close(client_socket);
-    return;
+    return NULL;
   }
   for (int i = 0; i < env_var_count; i++) {
     char *escaped_value = escape_json(env_vars[i].value);
     if (!escaped_value) {
       perror("escape_json failed");
       free(json);
-      close(client_socket);
-      return;
+      return NULL;
     }
     char *new_json;
     if (pretty) {
@@ -433,16 +3433,14 @@ void serve_json(int client_socket, int pretty) {
         perror("asprintf failed");
         free(json);
         free(escaped_value);
-        close(client_socket);
-        return;
+        return NULL;
       }
     } else {
       if (asprintf(&new_json, "%s\"%s\":\"%s\",", json, env_vars[i].key, escaped_value) == -1) {
         perror("asprintf failed");
         free(json);
         free(escaped_value);
-        close(client_socket);
-        return;
+        return NULL;
       }
     }
     free(json);
@@ -455,12 +3453,10 @@ void serve_json(int client_socket, int pretty) {
   } else {
     strcpy(json, "{}");
   }
-  send_response(client_socket, content_type, json);
-  free(json);
+  return json;
 }
 
-void serve_yaml(int client_socket) {
-  char *content_type = debug ? "text/yaml" : "application/yaml";
+char *render_yaml() {
   size_t yaml_size = 0;
   for (int i = 0; i < env_var_count; i++) {
     yaml_size += strlen(env_vars[i].key) + strlen(env_vars[i].value) * 2 + 5;
@@ -468,8 +3464,7 @@ void serve_yaml(int client_socket) {
   char *yaml = malloc(yaml_size + 4 + 1);
   if (!yaml) {
     perror("malloc failed");
-    close(client_socket);
-    return;
+    return NULL;
   }
   strcpy(yaml, "---\n");
   for (int i = 0; i < env_var_count; i++) {
@@ -490,8 +3485,7 @@ void serve_yaml(int client_socket) {
       free(yaml);
       free(escaped_key);
       free(escaped_value);
-      close(client_socket);
-      return;
+      return NULL;
     }
     strcat(yaml, escaped_key);
     strcat(yaml, ": ");
@@ -500,11 +3494,10 @@ void serve_yaml(int client_socket) {
     free(escaped_key);
     free(escaped_value);
   }
-  send_response(client_socket, content_type, yaml);
-  free(yaml);
+  return yaml;
 }
 
-void serve_shell(int client_socket, int export_mode) {
+char *render_shell(int export_mode) {
   size_t env_size = 0;
   for (int i = 0; i < env_var_count; i++) {
     env_size += strlen(env_vars[i].key) + strlen(env_vars[i].value) * 2 + 3;
@@ -515,8 +3508,7 @@ void serve_shell(int client_socket, int export_mode) {
   char *env_content = malloc(env_size + 1);
   if (!env_content) {
     perror("malloc failed");
-    close(client_socket);
-    return;
+    return NULL;
   }
   env_content[0] = '\0';
   for (int i = 0; i < env_var_count; i++) {
@@ -529,18 +3521,16 @@ void serve_shell(int client_socket, int export_mode) {
     if (!escaped_value) {
       perror("escape_env failed");
       free(env_content);
-      close(client_socket);
-      return;
+      return NULL;
     }
     strcat(env_content, escaped_value);
     strcat(env_content, "\"\n");
     free(escaped_value);
   }
-  send_response(client_socket, "text/plain", env_content);
-  free(env_content);
+  return env_content;
 }
 
-void serve_sys(int client_socket) {
+void serve_sys(int client_socket, int flags) {
   struct utsname sys_info;
   if (uname(&sys_info) < 0) {
     perror("uname failed");
@@ -561,129 +3551,506 @@ void serve_sys(int client_socket) {
            sys_info.version,
            sys_info.machine);
 
-  send_response(client_socket, "text/plain", response);
+  send_response(client_socket, "text/plain", response, flags & OPT_HEAD);
 }
 
 void add_patterns(char *spec, PatternType type) {
-  if (pattern_action_count < MAX_PATTERNS) {
-    pattern_actions[pattern_action_count].type = type;
-    pattern_actions[pattern_action_count].pattern = strdup(spec);
-    pattern_action_count++;
+  if (pattern_action_count == pattern_action_cap) {
+    int cap = pattern_action_cap ? pattern_action_cap * 2 : 64;
+    PatternAction *actions = realloc(pattern_actions, cap * sizeof(PatternAction));
+    if (!actions) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    pattern_actions = actions;
+    pattern_action_cap = cap;
+  }
+  pattern_actions[pattern_action_count].type = type;
+  pattern_actions[pattern_action_count].pattern = strdup(spec);
+  if (!pattern_actions[pattern_action_count].pattern) {
+    perror("strdup failed");
+    exit(EXIT_FAILURE);
   }
+  pattern_action_count++;
 }
 
-void load_environment() {
-  extern char **environ;
-  for (char **env = environ; *env && env_var_count < MAX_ENV_VARS; ++env) {
-    char *env_entry = strdup(*env);
-    char *key = strtok(env_entry, "=");
-    char *value = strtok(NULL, "");
-    if (key && value) {
-      int include = 1;
-      if (strcmp(key, "PATH") == 0 || strcmp(key, "HOME") == 0) {
-        include = 0;
-      }
-      for (int i = 0; i < pattern_action_count; i++) {
-        if (fnmatch(pattern_actions[i].pattern, key, 0) == 0) {
-          if (pattern_actions[i].type == PATTERN_INCLUDE) {
-            include = 1;
-          } else if (pattern_actions[i].type == PATTERN_EXCLUDE) {
-            include = 0;
-          }
-        }
-      }
-      if (include) {
-        env_vars[env_var_count].key = strdup(key);
-        env_vars[env_var_count].value = strdup(value);
-        env_var_count++;
+static NameSlot *name_table_slot(const NameTable *t, const char *name) {
+  size_t mask = t->cap - 1;
+  for (size_t i = hash_bytes(name, strlen(name)) & mask; ; i = (i + 1) & mask) {
+    if (!t->slots[i].name || strcmp(t->slots[i].name, name) == 0) { return &t->slots[i]; }
+  }
+}
+
+static NameSlot *name_table_find(const NameTable *t, const char *name) {
+  if (t->count == 0) { return NULL; }
+  NameSlot *slot = name_table_slot(t, name);
+  return slot->name ? slot : NULL;
+}
+
+// Sets a name's value, returns -1 if out of memory
+static int name_table_put(NameTable *t, const char *name, int value) {
+  if ((t->count + 1) * 2 > t->cap) {
+    // Keep it at most half full
+    NameTable bigger = { NULL, t->count, t->cap ? t->cap * 2 : 64 };
+    bigger.slots = calloc(bigger.cap, sizeof(NameSlot));
+    if (!bigger.slots) { return -1; }
+    for (int i = 0; i < t->cap; i++) {
+      if (t->slots[i].name) { *name_table_slot(&bigger, t->slots[i].name) = t->slots[i]; }
+    }
+    free(t->slots);
+    *t = bigger;
+  }
+  NameSlot *slot = name_table_slot(t, name);
+  if (!slot->name) {
+    slot->name = strdup(name);
+    if (!slot->name) { return -1; }
+    t->count++;
+  }
+  slot->value = value;
+  return 0;
+}
+
+static int trie_node(unsigned char c) {
+  if (prefix_trie_count == prefix_trie_cap) {
+    int cap = prefix_trie_cap ? prefix_trie_cap * 2 : 256;
+    TrieNode *nodes = realloc(prefix_trie, cap * sizeof(TrieNode));
+    if (!nodes) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    prefix_trie = nodes;
+    prefix_trie_cap = cap;
+  }
+  prefix_trie[prefix_trie_count] = (TrieNode){ 0, 0, -1, c };
+  return prefix_trie_count++;
+}
+
+// Returns the child of node for c, adding it if asked
+static int trie_child(int node, unsigned char c, int add) {
+  int child = prefix_trie[node].child;
+  while (child && prefix_trie[child].c != c) { child = prefix_trie[child].sibling; }
+  if (!child && add) {
+    child = trie_node(c);
+    prefix_trie[child].sibling = prefix_trie[node].child;
+    prefix_trie[node].child = child;
+  }
+  return child;
+}
+
+// The longest run of plain characters in a glob, so most keys can be ruled
+// out with strstr() before fnmatch(). Bracket expressions can hold ], as in
+// []x] or [[:upper:]], so nothing from the first [ onwards is used.
+static char *glob_needle(const char *pattern) {
+  const char *best = pattern;
+  size_t best_len = 0;
+  const char *run = pattern;
+  for (const char *p = pattern; ; p++) {
+    if (!*p || *p == '*' || *p == '?' || *p == '[' || *p == '\\') {
+      if ((size_t)(p - run) > best_len) {
+        best = run;
+        best_len = p - run;
       }
+      if (!*p || *p == '[') { break; }
+      if (*p == '\\' && p[1]) { p++; }
+      run = p + 1;
     }
-    free(env_entry);
   }
+  return strndup(best, best_len);
 }
 
-void send_response(int client_socket, const char *content_type, const char *response) {
-  size_t response_len = strlen(response);
-  int header_length = snprintf(NULL, 0,
-                               "HTTP/1.1 200 OK\r\n"
-                               "Content-Type: %s; charset=utf-8\r\n"
-                               "Content-Length: %zu\r\n"
-                               "Hostname: %s\r\n"
-                               "\r\n",
-                               content_type, response_len, hostname) + 1;
-  char *header_buffer = malloc(header_length);
-  if (!header_buffer) {
+// Sorts the pattern actions into the literal table, prefix trie and globs
+void compile_patterns() {
+  trie_node('\0'); // The root, for a bare *
+  glob_patterns = malloc((pattern_action_count + 1) * sizeof(GlobPattern));
+  if (!glob_patterns) {
     perror("malloc failed");
-    return;
+    exit(EXIT_FAILURE);
   }
-  snprintf(header_buffer, header_length,
-           "HTTP/1.1 200 OK\r\n"
-           "Content-Type: %s; charset=utf-8\r\n"
-           "Content-Length: %zu\r\n"
-           "Hostname: %s\r\n"
-           "\r\n",
-           content_type, response_len, hostname);
-  if (send(client_socket, header_buffer, header_length - 1, 0) < 0) {
-    perror("send headers failed");
-    free(header_buffer);
-    return;
+  for (int i = 0; i < pattern_action_count; i++) {
+    const char *pattern = pattern_actions[i].pattern;
+    size_t len = strcspn(pattern, "*?[\\");
+    if (!pattern[len]) {
+      if (name_table_put(&literal_patterns, pattern, i) < 0) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+      }
+    } else if (pattern[len] == '*' && !pattern[len + 1]) {
+      int node = 0;
+      for (size_t j = 0; j < len; j++) { node = trie_child(node, pattern[j], 1); }
+      prefix_trie[node].last = i;
+    } else {
+      GlobPattern *glob = &glob_patterns[glob_pattern_count++];
+      glob->index = i;
+      glob->needle = glob_needle(pattern);
+      if (!glob->needle) {
+        perror("strdup failed");
+        exit(EXIT_FAILURE);
+      }
+    }
   }
-  free(header_buffer);
-  size_t total_sent = 0;
-  size_t total_length = response_len;
-  const char *response_ptr = response;
-
-  while (total_sent < total_length) {
-    size_t chunk_size = (
-        (total_length - total_sent) < BUFFER_SIZE
-        ? (total_length - total_sent)
-        : BUFFER_SIZE
-    );
-    ssize_t sent = send(client_socket, response_ptr + total_sent, chunk_size, 0);
-    if (sent < 0) {
-      perror("send body failed");
+}
+
+static int include_var(const char *key) {
+  NameSlot *cached = name_table_find(&decision_cache, key);
+  if (cached) { return cached->value; }
+  int last = -1;
+  NameSlot *literal = name_table_find(&literal_patterns, key);
+  if (literal) { last = literal->value; }
+  int node = 0;
+  if (prefix_trie[node].last > last) { last = prefix_trie[node].last; }
+  for (const char *p = key; *p && (node = trie_child(node, *p, 0)); p++) {
+    if (prefix_trie[node].last > last) { last = prefix_trie[node].last; }
+  }
+  // Only globs given after the best match so far can change the outcome
+  for (int i = glob_pattern_count - 1; i >= 0 && glob_patterns[i].index > last; i--) {
+    const GlobPattern *glob = &glob_patterns[i];
+    if (strstr(key, glob->needle) && fnmatch(pattern_actions[glob->index].pattern, key, 0) == 0) {
+      last = glob->index;
       break;
     }
-    total_sent += sent;
   }
+  int include;
+  if (last >= 0) {
+    include = pattern_actions[last].type == PATTERN_INCLUDE;
+  } else {
+    include = strcmp(key, "PATH") != 0 && strcmp(key, "HOME") != 0;
+  }
+  if (decision_cache.count < MAX_CACHED_DECISIONS) {
+    name_table_put(&decision_cache, key, include); // Just not cached if out of memory
+  }
+  return include;
+}
+
+// Filters a KEY=VALUE entry into vars, returns the new count
+static int collect_entry(const char *entry, EnvVar *vars, int count) {
+  char *env_entry = strdup(entry);
+  if (!env_entry) { return count; }
+  char *key = strtok(env_entry, "=");
+  char *value = strtok(NULL, "");
+  if (key && value && include_var(key)) {
+    vars[count].key = strdup(key);
+    vars[count].value = strdup(value);
+    count++;
+  }
+  free(env_entry);
+  return count;
+}
+
+// Reads a whole file, NUL-terminated. Files under /proc report no size, so
+// the buffer grows as it fills.
+static char *read_file(const char *path, size_t *len) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "Could not read %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  size_t cap = BUFFER_SIZE * 8;
+  size_t used = 0;
+  char *data = malloc(cap);
+  while (data) {
+    if (used + 1 == cap) {
+      char *bigger = realloc(data, cap *= 2);
+      if (!bigger) { free(data); data = NULL; break; }
+      data = bigger;
+    }
+    ssize_t n = read(fd, data + used, cap - used - 1);
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n < 0) {
+      fprintf(stderr, "Could not read %s: %s\n", path, strerror(errno));
+      free(data);
+      data = NULL;
+    }
+    if (n <= 0) { break; }
+    used += n;
+  }
+  close(fd);
+  if (!data) { return NULL; }
+  data[used] = '\0';
+  *len = used;
+  return data;
+}
+
+// The server's own environment, NUL-separated like /proc/PID/environ
+static char *read_own_environ(const char *arg, size_t *len) {
+  extern char **environ;
+  (void)arg;
+  size_t total = 0;
+  for (char **env = environ; *env; ++env) {
+    total += strlen(*env) + 1;
+  }
+  char *data = malloc(total + 1);
+  if (!data) {
+    perror("malloc failed");
+    return NULL;
+  }
+  char *p = data;
+  for (char **env = environ; *env; ++env) {
+    size_t entry_len = strlen(*env) + 1;
+    memcpy(p, *env, entry_len);
+    p += entry_len;
+  }
+  *p = '\0';
+  *len = total;
+  return data;
+}
+
+static char *read_proc_environ(const char *pid, size_t *len) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%s/environ", pid);
+  return read_file(path, len);
+}
+
+static const EnvSource env_sources[SOURCE_COUNT] = {
+  [SOURCE_ENV] = { "env", read_own_environ, '\0' },
+  [SOURCE_PROC] = { "proc", read_proc_environ, '\0' },
+  [SOURCE_FILE] = { "file", read_file, '\n' },
+};
+
+// Parses env, proc:PID or file:PATH for -s
+int set_env_source(const char *spec) {
+  const char *colon = strchr(spec, ':');
+  size_t name_len = colon ? (size_t)(colon - spec) : strlen(spec);
+  for (int i = 0; i < SOURCE_COUNT; i++) {
+    if (strlen(env_sources[i].name) != name_len ||
+        strncmp(env_sources[i].name, spec, name_len) != 0) {
+      continue;
+    }
+    const char *arg = colon ? colon + 1 : NULL;
+    if (i == SOURCE_ENV ? arg != NULL : !arg || !*arg) { return -1; }
+    if (i == SOURCE_PROC && arg[strspn(arg, "0123456789")]) { return -1; }
+    env_source = i;
+    env_source_arg = arg;
+    return 0;
+  }
+  return -1;
+}
+
+// A line of an env file: skips blanks and comments, and strips quotes
+// around the value as docker's env files allow
+static int collect_line(char *line, size_t len, EnvVar *vars, int count) {
+  while (len > 0 && line[len - 1] == '\r') {
+    line[--len] = '\0';
+  }
+  if (len == 0 || line[0] == '#') { return count; }
+  char *eq = strchr(line, '=');
+  if (eq && len - (eq - line) >= 3 && (eq[1] == '"' || eq[1] == '\'') &&
+      line[len - 1] == eq[1]) {
+    memmove(eq + 1, eq + 2, len - (eq - line) - 3);
+    line[len - 2] = '\0';
+  }
+  return collect_entry(line, vars, count);
+}
+
+// Splits raw source contents into entries, filtering them into vars
+static int collect_environment(EnvVar *vars, char *data, size_t len, char separator) {
+  int count = 0;
+  char *end = data + len;
+  for (char *entry = data; entry < end && count < MAX_ENV_VARS; ) {
+    char *next = memchr(entry, separator, end - entry);
+    if (!next) { next = end; }
+    *next = '\0';
+    if (separator == '\n') {
+      count = collect_line(entry, next - entry, vars, count);
+    } else {
+      count = collect_entry(entry, vars, count);
+    }
+    entry = next + 1;
+  }
+  return count;
+}
+
+// FNV-1a
+static unsigned long long hash_bytes(const char *data, size_t len) {
+  unsigned long long hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+#define SOURCE_UNCHANGED -2
+
+// Reads the env source into vars. Returns the count, -1 on failure, or
+// SOURCE_UNCHANGED without parsing if its contents are as last parsed.
+static int read_environment(EnvVar *vars) {
+  const EnvSource *source = &env_sources[env_source];
+  size_t len;
+  char *data = source->read(env_source_arg, &len);
+  if (!data) {
+    source_stats.failed++;
+    return -1;
+  }
+  unsigned long long hash = hash_bytes(data, len);
+  if (env_source_hashed && hash == env_source_hash) {
+    free(data);
+    source_stats.unchanged++;
+    return SOURCE_UNCHANGED;
+  }
+  int count = collect_environment(vars, data, len, source->separator);
+  free(data);
+  env_source_hash = hash;
+  env_source_hashed = 1;
+  source_stats.parsed++;
+  return count;
+}
+static void free_environment(EnvVar *vars, int count) {
+  for (int i = 0; i < count; i++) {
+    free(vars[i].key);
+    free(vars[i].value);
+  }
+}
+
+static const char *find_value(EnvVar *vars, int count, const char *key) {
+  for (int i = 0; i < count; i++) {
+    if (strcmp(vars[i].key, key) == 0) { return vars[i].value; }
+  }
+  return NULL;
+}
+
+// Appends ,"key" (or "key" when first) to a JSON list under construction
+static int append_json_key(char **list, const char *key) {
+  char *escaped = escape_json(key);
+  if (!escaped) { return -1; }
+  char *new_list;
+  int rc = asprintf(&new_list, "%s%s\"%s\"", *list, **list ? "," : "", escaped);
+  free(escaped);
+  if (rc == -1) { return -1; }
+  free(*list);
+  *list = new_list;
+  return 0;
 }
 
-void send_binary_response(int client_socket, const char *content_type, const unsigned char *data, size_t len) {
-  int header_length = snprintf(NULL, 0,
-                               "HTTP/1.1 200 OK\r\n"
-                               "Content-Type: %s\r\n"
-                               "Content-Length: %zu\r\n"
-                               "Hostname: %s\r\n"
-                               "\r\n",
-                               content_type, len, hostname) + 1;
-  char *header_buffer = malloc(header_length);
-  if (!header_buffer) {
+void load_environment() {
+  int count = read_environment(env_vars);
+  if (count < 0) { exit(EXIT_FAILURE); }
+  env_var_count = count;
+}
+
+void reload_environment() {
+  EnvVar *vars = malloc(MAX_ENV_VARS * sizeof(EnvVar));
+  if (!vars) {
     perror("malloc failed");
     return;
   }
-  snprintf(header_buffer, header_length,
-           "HTTP/1.1 200 OK\r\n"
-           "Content-Type: %s\r\n"
-           "Content-Length: %zu\r\n"
-           "Hostname: %s\r\n"
-           "\r\n",
-           content_type, len, hostname);
-  if (send(client_socket, header_buffer, header_length - 1, 0) < 0) {
-    perror("send headers failed");
-    free(header_buffer);
+  int count = read_environment(vars);
+  if (count == SOURCE_UNCHANGED) {
+    if (debug) { printf("Env source unchanged (version %lu)\n", env_version); fflush(stdout); }
+  }
+  if (count < 0) {
+    free(vars);
     return;
   }
-  free(header_buffer);
+  char *changed = strdup("");
+  char *removed = strdup("");
+  int failed = !changed || !removed;
+  for (int i = 0; i < count && !failed; i++) {
+    const char *old = find_value(env_vars, env_var_count, vars[i].key);
+    if (!old || strcmp(old, vars[i].value) != 0) {
+      failed = append_json_key(&changed, vars[i].key) < 0;
+    }
+  }
+  for (int i = 0; i < env_var_count && !failed; i++) {
+    if (!find_value(vars, count, env_vars[i].key)) {
+      failed = append_json_key(&removed, env_vars[i].key) < 0;
+    }
+  }
+  if (failed) {
+    perror("reload failed");
+    env_source_hashed = 0; // Parse again next time
+    free_environment(vars, count);
+  } else if (!*changed && !*removed && count == env_var_count) {
+    if (debug) { printf("Reload found no changes (version %lu)\n", env_version); fflush(stdout); }
+    free_environment(vars, count);
+  } else {
+    free_environment(env_vars, env_var_count);
+    memcpy(env_vars, vars, count * sizeof(EnvVar));
+    env_var_count = count;
+    env_version++;
+    char *change;
+    if (asprintf(&change, "{\"version\":%lu,\"changed\":[%s],\"removed\":[%s]}",
+                 env_version, changed, removed) != -1) {
+      free(last_change);
+      last_change = change;
+    }
+    if (debug) { printf("Reloaded environment (version %lu)\n", env_version); fflush(stdout); }
+    wake_parked();
+  }
+  free(changed);
+  free(removed);
+  free(vars);
+}
+
+// Builds a 200 response with its headers, returns NULL on failure
+static char *build_response(const char *content_type, int text, const void *body,
+                            size_t len, size_t *header_len) {
+  const char *format =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: %s%s\r\n"
+    "Content-Length: %zu\r\n"
+    "Hostname: %s\r\n"
+    "Env-Version: %lu\r\n"
+    "\r\n";
+  const char *charset = text ? "; charset=utf-8" : "";
+  int header_length = snprintf(NULL, 0, format, content_type, charset, len,
+                               hostname, env_version);
+  char *response = malloc(header_length + len + 1);
+  if (!response) {
+    perror("malloc failed");
+    return NULL;
+  }
+  snprintf(response, header_length + 1, format, content_type, charset, len,
+           hostname, env_version);
+  memcpy(response + header_length, body, len);
+  response[header_length + len] = '\0';
+  *header_len = header_length;
+  return response;
+}
+
+static void send_all(int client_socket, const char *data, size_t len) {
+  PROF_BEGIN(SEND);
   size_t total_sent = 0;
+  if (h2_sink) {
+    h2_capture(data, len);
+    total_sent = len;
+  }
   while (total_sent < len) {
-    size_t chunk_size = (len - total_sent) < (size_t)BUFFER_SIZE ? (len - total_sent) : (size_t)BUFFER_SIZE;
-    ssize_t sent = send(client_socket, data + total_sent, chunk_size, 0);
+    ssize_t sent = send(client_socket, data + total_sent, len - total_sent, 0);
     if (sent < 0) {
-      perror("send body failed");
+      if (errno == EINTR) { continue; }
+      perror("send failed");
       break;
     }
     total_sent += (size_t)sent;
   }
+  current_request.bytes += total_sent;
+  PROF_END(SEND);
+}
+
+void send_response(int client_socket, const char *content_type, const char *response, int head) {
+  size_t header_len;
+  size_t len = strlen(response);
+  char *buffer = build_response(content_type, 1, response, len, &header_len);
+  if (!buffer) { return; }
+  current_request.status = 200;
+  send_all(client_socket, buffer, head ? header_len : header_len + len);
+  free(buffer);
+}
+
+void send_binary_response(int client_socket, const char *content_type, const unsigned char *data, size_t len, int head) {
+  size_t header_len;
+  char *buffer = build_response(content_type, 0, data, len, &header_len);
+  if (!buffer) { return; }
+  current_request.status = 200;
+  send_all(client_socket, buffer, head ? header_len : header_len + len);
+  free(buffer);
+}
+
+// Errors keep their Content-Length but lose the body when answering HEAD
+static size_t error_length(const char *buffer, size_t len) {
+  if (current_request.flags & OPT_HEAD) {
+    return strstr(buffer, "\r\n\r\n") + 4 - buffer;
+  }
+  return len;
 }
 
 void send_error_response(int client_socket, const char *status, const char *message) {
@@ -694,7 +4061,21 @@ void send_error_response(int client_socket, const char *status, const char *mess
            "Content-Length: %zu\r\n"
            "\r\n"
            "%s\n", status, strlen(message) + 1, message);
-  send(client_socket, buffer, strlen(buffer), 0);
+  current_request.status = atoi(status);
+  send_all(client_socket, buffer, error_length(buffer, strlen(buffer)));
+}
+
+void send_retry_response(int client_socket, const char *status, const char *message, int retry_after) {
+  char buffer[BUFFER_SIZE];
+  int len = snprintf(buffer, sizeof(buffer),
+                     "HTTP/1.1 %s\r\n"
+                     "Content-Type: text/plain; charset=utf-8\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Retry-After: %d\r\n"
+                     "\r\n"
+                     "%s\n", status, strlen(message) + 1, retry_after, message);
+  current_request.status = atoi(status);
+  send_all(client_socket, buffer, error_length(buffer, len));
 }
 
 /*
@@ -730,6 +4111,7 @@ void serve_file(int client_socket, const char *file_path, const char *content_ty
 */
 
 char *escape_json(const char *input) {
+  PROF_BEGIN(ESCAPE);
   size_t len = strlen(input);
   char *escaped = malloc(len * 2 + 1);
   char *p = escaped;
@@ -746,10 +4128,12 @@ char *escape_json(const char *input) {
     }
   }
   *p = '\0';
+  PROF_END(ESCAPE);
   return escaped;
 }
 
 char *escape_html(const char *input) {
+  PROF_BEGIN(ESCAPE);
   size_t len = strlen(input);
   char *escaped = malloc(len * 6 + 1);
   if (!escaped) { return NULL; }
@@ -765,10 +4149,12 @@ char *escape_html(const char *input) {
     }
   }
   *p = '\0';
+  PROF_END(ESCAPE);
   return escaped;
 }
 
 char *escape_yaml(const char *input) {
+  PROF_BEGIN(ESCAPE);
   size_t len = strlen(input);
   char *escaped = malloc(len * 2 + 3);
   if (!escaped) { return NULL; }
@@ -780,10 +4166,12 @@ char *escape_yaml(const char *input) {
   }
   *p++ = '\"';
   *p = '\0';
+  PROF_END(ESCAPE);
   return escaped;
 }
 
 char *escape_env(const char *input) {
+  PROF_BEGIN(ESCAPE);
   size_t len = strlen(input);
   char *escaped = malloc(len * 2 + 1);
   if (!escaped) { return NULL; }
@@ -793,10 +4181,12 @@ char *escape_env(const char *input) {
     *p++ = *s;
   }
   *p = '\0';
+  PROF_END(ESCAPE);
   return escaped;
 }
 
 char *escape_url(const char *src) {
+  PROF_BEGIN(ESCAPE);
   size_t src_len = strlen(src);
   char *enc = malloc(src_len * 3 + 1);
   if (!enc) { return NULL; }
@@ -811,6 +4201,7 @@ char *escape_url(const char *src) {
     }
   }
   *penc = '\0';
+  PROF_END(ESCAPE);
   return enc;
 }
 
@@ -829,6 +4220,91 @@ static int is_valid_var_name(const char *s) {
   return 1;
 }
 
+// Decodes %XX escapes (and '+' when plus_space), rejecting bad escapes and NULs
+static int percent_decode(char *dst, const char *src, size_t len, int plus_space) {
+  size_t out = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (src[i] == '%') {
+      if (i + 2 >= len) { return -1; }
+      if (!isxdigit((unsigned char)src[i + 1]) || !isxdigit((unsigned char)src[i + 2])) {
+        return -1;
+      }
+      char hex[3] = { src[i + 1], src[i + 2], '\0' };
+      char c = (char)strtol(hex, NULL, 16);
+      if (c == '\0') { return -1; }
+      dst[out++] = c;
+      i += 2;
+    } else if (plus_space && src[i] == '+') {
+      dst[out++] = ' ';
+    } else {
+      dst[out++] = src[i];
+    }
+  }
+  dst[out] = '\0';
+  return (int)out;
+}
+
+// Flags are on when present unless given a false-ish value (?pretty=0)
+static int query_flag(const char *value, int has_value) {
+  if (!has_value) { return 1; }
+  const char *off[] = { "0", "false", "no", "off", NULL };
+  for (int i = 0; off[i] != NULL; i++) {
+    if (strcasecmp(value, off[i]) == 0) { return 0; }
+  }
+  return 1;
+}
+
+// Parses name[=value]&... into opts, returns -1 on malformed input
+static int parse_query(const char *query, RequestOptions *opts) {
+  while (*query) {
+    size_t param_len = strcspn(query, "&");
+    size_t name_len = strcspn(query, "=&");
+    int has_value = name_len < param_len;
+    const char *raw_value = query + name_len + has_value;
+    size_t value_len = param_len - (raw_value - query);
+    char name[16];
+    char value[32];
+    // Unknown or overlong parameters are skipped, so short buffers suffice
+    if (name_len < sizeof(name)) {
+      if (percent_decode(name, query, name_len, 1) < 0) { return -1; }
+      if (value_len >= sizeof(value)) {
+        name[0] = '\0';
+      } else if (percent_decode(value, raw_value, value_len, 1) < 0) {
+        return -1;
+      }
+      char *end;
+      int flag = strcmp(name, "pretty") == 0 ? OPT_PRETTY
+               : strcmp(name, "export") == 0 ? OPT_EXPORT
+               : strcmp(name, "trace") == 0 ? OPT_TRACE : 0;
+      if (flag) {
+        if (query_flag(value, has_value)) { opts->flags |= flag; } else { opts->flags &= ~flag; }
+      } else if (strcmp(name, "wait") == 0) {
+        opts->wait = strtoul(value, &end, 10);
+        if (!*value || *end) { return -1; }
+        opts->flags |= OPT_WAIT;
+      } else if (strcmp(name, "timeout") == 0) {
+        opts->timeout = strtol(value, &end, 10);
+        if (!*value || *end) { return -1; }
+        if (opts->timeout < 0) { opts->timeout = 0; }
+        if (opts->timeout > MAX_WAIT_TIMEOUT) { opts->timeout = MAX_WAIT_TIMEOUT; }
+      }
+    }
+    query += param_len;
+    if (*query == '&') { query++; }
+  }
+  return 0;
+}
+
+static long long now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long now_ms(void) {
+  return now_us() / 1000;
+}
+
 char* get_env_var_value(const char *key) {
   for (int i = 0; i < env_var_count; i++) {
     if (strcmp(env_vars[i].key, key) == 0) { return env_vars[i].value; }
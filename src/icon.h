@@ -0,0 +1,545 @@
+const unsigned char icon_png[] = {
+ 0x89,
+ 0x50,
+ 0x4e,
+ 0x47,
+ 0x0d,
+ 0x0a,
+ 0x1a,
+ 0x0a,
+ 0x00,
+ 0x00,
+ 0x00,
+ 0x0d,
+ 0x49,
+ 0x48,
+ 0x44,
+ 0x52,
+ 0x00,
+ 0x00,
+ 0x00,
+ 0x40,
+ 0x00,
+ 0x00,
+ 0x00,
+ 0x40,
+ 0x04,
+ 0x03,
+ 0x00,
+ 0x00,
+ 0x00,
+ 0x58,
+ 0x47,
+ 0x6c,
+ 0xed,
+ 0x00,
+ 0x00,
+ 0x00,
+ 0x04,
+ 0x67,
+ 0x41,
+ 0x4d,
+ 0x41,
+ 0x00,
+ 0x00,
+ 0xb1,
+ 0x8f,
+ 0x0b,
+ 0xfc,
+ 0x61,
+ 0x05,
+ 0x00,
+ 0x00,
+ 0x00,
+ 0x01,
+ 0x73,
+ 0x52,
+ 0x47,
+ 0x42,
+ 0x00,
+ 0xae,
+ 0xce,
+ 0x1c,
+ 0xe9,
+ 0x00,
+ 0x00,
+ 0x00,
+ 0x2a,
+ 0x50,
+ 0x4c,
+ 0x54,
+ 0x45,
+ 0x47,
+ 0x70,
+ 0x4c,
+ 0x00,
+ 0x2b,
+ 0xff,
+ 0x00,
+ 0x2b,
+ 0xff,
+ 0x00,
+ 0x2b,
+ 0xff,
+ 0x00,
+ 0x2b,
+ 0xff,
+ 0x00,
+ 0x2b,
+ 0xff,
+ 0xc5,
+ 0xca,
+ 0x9d,
+ 0x00,
+ 0x2b,
+ 0xff,
+ 0xa7,
+ 0xae,
+ 0xb5,
+ 0x8d,
+ 0x96,
+ 0xc7,
+ 0x33,
+ 0x49,
+ 0xf4,
+ 0x52,
+ 0x62,
+ 0xe8,
+ 0x71,
+ 0x7d,
+ 0xd8,
+ 0x1c,
+ 0x38,
+ 0xfb,
+ 0xeb,
+ 0x5b,
+ 0xe5,
+ 0xe6,
+ 0x00,
+ 0x00,
+ 0x00,
+ 0x06,
+ 0x74,
+ 0x52,
+ 0x4e,
+ 0x53,
+ 0x00,
+ 0xf0,
+ 0x90,
+ 0xcb,
+ 0x18,
+ 0x3f,
+ 0x32,
+ 0x55,
+ 0x7a,
+ 0xad,
+ 0x00,
+ 0x00,
+ 0x01,
+ 0x80,
+ 0x49,
+ 0x44,
+ 0x41,
+ 0x54,
+ 0x48,
+ 0xc7,
+ 0xa5,
+ 0x96,
+ 0xb1,
+ 0x4e,
+ 0xc3,
+ 0x30,
+ 0x10,
+ 0x86,
+ 0x4d,
+ 0x81,
+ 0x1d,
+ 0x84,
+ 0x50,
+ 0xd7,
+ 0x4a,
+ 0x20,
+ 0xb1,
+ 0x02,
+ 0x0b,
+ 0x6b,
+ 0xe1,
+ 0x09,
+ 0x60,
+ 0xe2,
+ 0x0d,
+ 0xae,
+ 0x09,
+ 0x94,
+ 0xa1,
+ 0x20,
+ 0x6a,
+ 0x9a,
+ 0xd2,
+ 0x35,
+ 0x08,
+ 0x1e,
+ 0xa0,
+ 0xa5,
+ 0x82,
+ 0x99,
+ 0x22,
+ 0xb1,
+ 0x53,
+ 0x81,
+ 0xd4,
+ 0x15,
+ 0x84,
+ 0xd4,
+ 0x19,
+ 0x06,
+ 0x5e,
+ 0x06,
+ 0x27,
+ 0xc6,
+ 0x3e,
+ 0xdb,
+ 0x75,
+ 0x7c,
+ 0x0a,
+ 0xdc,
+ 0xe4,
+ 0xc4,
+ 0x5f,
+ 0xce,
+ 0xbe,
+ 0x3b,
+ 0xfb,
+ 0xbf,
+ 0x30,
+ 0x96,
+ 0xd9,
+ 0xe2,
+ 0xda,
+ 0x16,
+ 0x77,
+ 0x6c,
+ 0x65,
+ 0x7b,
+ 0x9f,
+ 0x69,
+ 0xdb,
+ 0xab,
+ 0x72,
+ 0x8f,
+ 0xb5,
+ 0xd6,
+ 0xd5,
+ 0x7c,
+ 0xc5,
+ 0x3b,
+ 0x2f,
+ 0x88,
+ 0x9a,
+ 0x9c,
+ 0x5f,
+ 0xd8,
+ 0xe1,
+ 0x05,
+ 0x76,
+ 0x56,
+ 0xcf,
+ 0x81,
+ 0x03,
+ 0x5e,
+ 0x68,
+ 0xab,
+ 0xb9,
+ 0x83,
+ 0x6a,
+ 0x31,
+ 0xb0,
+ 0x9c,
+ 0xb9,
+ 0x98,
+ 0xe7,
+ 0x01,
+ 0xdb,
+ 0x14,
+ 0xc0,
+ 0x46,
+ 0x08,
+ 0x38,
+ 0x0d,
+ 0xaf,
+ 0x20,
+ 0x02,
+ 0xa9,
+ 0xb3,
+ 0x0a,
+ 0x0f,
+ 0x5a,
+ 0x8d,
+ 0xcd,
+ 0x85,
+ 0x81,
+ 0x25,
+ 0x76,
+ 0x18,
+ 0x06,
+ 0xce,
+ 0xc3,
+ 0x7b,
+ 0xcc,
+ 0x76,
+ 0xa9,
+ 0xd3,
+ 0x98,
+ 0x7c,
+ 0x0c,
+ 0xaf,
+ 0xe5,
+ 0xe8,
+ 0x76,
+ 0x38,
+ 0x1d,
+ 0xe9,
+ 0x64,
+ 0x6a,
+ 0x20,
+ 0xe9,
+ 0x03,
+ 0x44,
+ 0x72,
+ 0x98,
+ 0x02,
+ 0xc4,
+ 0x23,
+ 0x0d,
+ 0xa8,
+ 0x28,
+ 0x1f,
+ 0xc0,
+ 0x04,
+ 0xe0,
+ 0x48,
+ 0xc5,
+ 0xc9,
+ 0x94,
+ 0xaf,
+ 0xd4,
+ 0x06,
+ 0x62,
+ 0xf5,
+ 0x5e,
+ 0x01,
+ 0x5d,
+ 0xb0,
+ 0x01,
+ 0x18,
+ 0xcf,
+ 0x02,
+ 0xd1,
+ 0x44,
+ 0x7d,
+ 0xf5,
+ 0x2d,
+ 0x90,
+ 0x77,
+ 0x07,
+ 0xb8,
+ 0x04,
+ 0x68,
+ 0x62,
+ 0x70,
+ 0x6f,
+ 0x5e,
+ 0xe0,
+ 0x18,
+ 0x81,
+ 0x67,
+ 0x80,
+ 0x81,
+ 0x03,
+ 0x74,
+ 0x70,
+ 0xe3,
+ 0x32,
+ 0x24,
+ 0x12,
+ 0xb8,
+ 0x72,
+ 0x80,
+ 0x0b,
+ 0x80,
+ 0x13,
+ 0x04,
+ 0x3e,
+ 0x29,
+ 0xa0,
+ 0xed,
+ 0x05,
+ 0x1a,
+ 0x16,
+ 0xd0,
+ 0x70,
+ 0x00,
+ 0xc3,
+ 0xa9,
+ 0xed,
+ 0x8f,
+ 0x61,
+ 0xe4,
+ 0x03,
+ 0x04,
+ 0x3a,
+ 0x98,
+ 0x6b,
+ 0x86,
+ 0x99,
+ 0x1e,
+ 0x23,
+ 0x90,
+ 0xe0,
+ 0xa3,
+ 0x04,
+ 0x5e,
+ 0x52,
+ 0x5d,
+ 0x08,
+ 0x5d,
+ 0x8e,
+ 0xe8,
+ 0xce,
+ 0x00,
+ 0xc4,
+ 0x59,
+ 0x80,
+ 0x1b,
+ 0x13,
+ 0x78,
+ 0xd4,
+ 0x05,
+ 0xd5,
+ 0x40,
+ 0xfc,
+ 0x65,
+ 0x02,
+ 0xbd,
+ 0x7e,
+ 0x79,
+ 0x20,
+ 0xbc,
+ 0x04,
+ 0xb9,
+ 0x49,
+ 0x37,
+ 0xcc,
+ 0xae,
+ 0x1b,
+ 0x66,
+ 0xbe,
+ 0x88,
+ 0x9d,
+ 0xa8,
+ 0x66,
+ 0xd9,
+ 0x54,
+ 0xb7,
+ 0xdd,
+ 0x62,
+ 0xfd,
+ 0xf3,
+ 0x3c,
+ 0xf8,
+ 0x81,
+ 0x92,
+ 0x67,
+ 0xd2,
+ 0x03,
+ 0xd8,
+ 0xc7,
+ 0xfe,
+ 0x2f,
+ 0x17,
+ 0x07,
+ 0x5e,
+ 0x7f,
+ 0xeb,
+ 0xd5,
+ 0x7b,
+ 0x82,
+ 0x59,
+ 0x80,
+ 0xbc,
+ 0xbc,
+ 0xee,
+ 0xf5,
+ 0xd7,
+ 0xa5,
+ 0xa3,
+ 0x05,
+ 0x84,
+ 0x94,
+ 0x20,
+ 0x14,
+ 0xb1,
+ 0x29,
+ 0x8a,
+ 0xd8,
+ 0xbd,
+ 0x21,
+ 0x62,
+ 0xa4,
+ 0x0c,
+ 0x92,
+ 0x42,
+ 0x4a,
+ 0x4a,
+ 0x31,
+ 0x29,
+ 0xe6,
+ 0x64,
+ 0x3b,
+ 0x20,
+ 0x1b,
+ 0x0a,
+ 0xdd,
+ 0x92,
+ 0x42,
+ 0x6b,
+ 0xb4,
+ 0xf2,
+ 0xbe,
+ 0xb8,
+ 0x4b,
+ 0xb4,
+ 0x45,
+ 0xba,
+ 0xb1,
+ 0x92,
+ 0xad,
+ 0x99,
+ 0x6e,
+ 0xee,
+ 0xc1,
+ 0xdf,
+ 0x83,
+ 0x1f,
+ 0xa5,
+ 0xdd,
+ 0x80,
+ 0xd8,
+ 0xb4,
+ 0xe3,
+ 0xd0,
+ 0xa2,
+ 0x00,
+ 0x00,
+ 0x00,
+ 0x00,
+ 0x49,
+ 0x45,
+ 0x4e,
+ 0x44,
+ 0xae,
+ 0x42,
+ 0x60,
+ 0x82,
+};
+const unsigned int icon_png_len = 542;
@@ -0,0 +1,11 @@
+#define ROUTE_SLOT_ROOT 0
+#define ROUTE_SLOT_ICON_PNG 13
+#define ROUTE_SLOT_JSON 5
+#define ROUTE_SLOT_YAML 14
+#define ROUTE_SLOT_SH 10
+#define ROUTE_SLOT_SYS 6
+#define ROUTE_SLOT_VAR 4
+#define ROUTE_SLOT_EVENTS 3
+#define ROUTE_SLOT_METRICS 12
+#define ROUTE_SLOT_DEBUG 1
+#define ROUTE_SLOTS 16
@@ -0,0 +1,59 @@
+const char* template =(  "<!DOCTYPE html>\n"
+  "<html>\n"
+  "<head>\n"
+  "<title>%s</title>\n"
+  "<meta charset=\"UTF-8\">\n"
+  "<link rel=\"icon\" type=\"image/png\" href=\"icon.png\">\n"
+  "<link rel=\"preconnect\" href=\"https://fonts.googleapis.com\">\n"
+  "<link rel=\"preconnect\" href=\"https://fonts.gstatic.com\" crossorigin>\n"
+  "<link href=\"https://fonts.googleapis.com/css2?family=Courier+Prime:ital,wght@0,400;0,700;1,400;1,700&family=Noto+Sans:ital,wght@0,100..900;1,100..900&display=swap\" rel=\"stylesheet\">\n"
+  "<style>\n"
+  ":root { --sans: \"Noto Sans\", sans-serif; --mono: \"Courier Prime\", Courier, monospace; }\n"
+  "body { font-family: var(--sans); background: linear-gradient(to right, #fff, #ffd, #fff); margin: 2rem; }\n"
+  "table { border-collapse: collapse; margin: 0 auto 1rem auto; }\n"
+  "th, td { padding: 0.75rem; border: 1px solid #888; text-align: left; }\n"
+  "td { font-family: var(--mono); }\n"
+  "th { background-color: #bbb; }\n"
+  "tr:nth-child(odd) { background-color: #eef; }\n"
+  "tr:nth-child(even) { background-color: #fff; }\n"
+  "a { text-decoration: underline; text-decoration-color: #0001; color: inherit }\n"
+  "a:hover { text-decoration: underline; text-decoration-color: #00f;  }\n"
+  "ul { padding: 0; margin: 0; list-style: none; text-align: center; }\n"
+  "li { display: inline; margin: 0; padding: 0 0.5rem 0 0.5rem; }\n"
+  "pre { font-family: var(--mono); margin: 0; padding: 0; }\n"
+  "footer { max-width: fit-content; margin: 1.5rem auto 0 auto; font-size: 0.7rem; font-weight: 200; text-align: center; color: #000; opacity: 0.4; line-height: 1.5rem; }\n"
+  "footer:hover { opacity: 1; }\n"
+  "footer a, footer a:hover { text-decoration: none; }\n"
+  "footer a:hover { font-weight: 600; }\n"
+  "div.badges { display: none; }\n"
+  "div.copyright:hover + div.badges { display: block; }\n"
+  "div.badges:hover { display: block; }\n"
+  "footer img { height: 1.25rem; vertical-align: middle; opacity: 0.4; padding: 0.3rem; }\n"
+  "footer img:hover { opacity: 1; }\n"
+  "</style>\n"
+  "</head>\n"
+  "<body>\n"
+  "<table>\n"
+  "<tr><th>Name</th><th>Value</th></tr>\n"
+  "%s\n"
+  "</table>\n"
+  "<ul>\n"
+  "  <li><a href=\"/json?pretty\" title=\"Download environment as JSON data\">JSON</a></li>\n"
+  "  <li><a href=\"/sh?export\" title=\"Download environment as Shell Script\">SHELL</a></li>\n"
+  "  <li><a href=\"/yaml\" title=\"Download environment as YAML data\">YAML</a></li>\n"
+  "</ul>\n"
+  "<footer>\n"
+  "  <div class=\"copyright\">\n"
+  "    <!-- Do not remove, as per MIT Link License; see LICENSE -->\n"
+  "    <a href=\"https://github.com/kilna/envhttpd\" target=\"_blank\">\n"
+  "      envhttpd <img src=\"icon.png\"/> Copyright © 2024 Kilna, Anthony\n"
+  "    </a>\n"
+  "  </div>\n"
+  "  <div class=\"badges\">\n"
+  "    <a href=\"https://hub.docker.com/r/kilna/envhttpd\" target=\"_blank\"><img src=\"https://img.shields.io/badge/DockerHub-kilna/envhttpd-blue?logo=docker\"/></a>\n"
+  "    <a href=\"https://github.com/kilna/envhttpd\" target=\"_blank\"><img src=\"https://img.shields.io/badge/GitHub-kilna/envhttpd-green?logo=github\"/></a>\n"
+  "  </div>\n"
+  "</footer>\n"
+  "</body>\n"
+  "</html>\n"
+);
@@ -0,0 +1,60 @@
+#!/bin/sh
+
+# Throughput of /json with no access log, with -l FILE and with -l -, from
+# 8 concurrent clients. Each setting is run several times, interleaved, and
+# the best run is kept. Run from the repo root:
+#
+#   sh test/bench-access-log.sh [path/to/envhttpd] [requests] [runs]
+
+set -e -u
+
+BIN="${1:-bin/envhttpd}"
+REQUESTS="${2:-20000}"
+RUNS="${3:-10}"
+PORT="${BENCH_PORT:-8126}"
+BASE_URL="http://localhost:${PORT}"
+
+DIR=$(mktemp -d)
+trap 'rm -rf "${DIR}"' EXIT
+
+now_us() { echo $(($(date +%s%N) / 1000)); }
+
+# Prints requests per second for one run of the server with the given flags
+run() {
+  env -i BENCH_ME=yes HOSTNAME=bench "${BIN}" -p ${PORT} "$@" >"${DIR}/stdout.log" 2>&1 &
+  pid=$!
+  until curl -s -o /dev/null "${BASE_URL}/json"; do :; done
+  start=$(now_us)
+  curl -s --no-progress-meter -Z --parallel-max 8 "${BASE_URL}/json?n=[1-${REQUESTS}]" >/dev/null
+  elapsed=$(($(now_us) - start))
+  dropped=$(curl -s "${BASE_URL}/metrics" \
+    | sed -n 's/^envhttpd_access_log_records_total{outcome="dropped"} //p')
+  kill ${pid}
+  wait ${pid} || true
+  if [ "${dropped:-0}" != 0 ]; then echo "Warning: ${dropped} records dropped" >&2; fi
+  echo $((REQUESTS * 1000000 / elapsed))
+}
+
+best_none=0
+best_file=0
+best_stdout=0
+for i in $(seq 1 ${RUNS}); do
+  rate=$(run -x '*' -i BENCH_ME)
+  echo "Run ${i}, no access log: ${rate} req/s"
+  [ ${rate} -gt ${best_none} ] && best_none=${rate}
+  rate=$(run -x '*' -i BENCH_ME -l "${DIR}/access.log")
+  echo "Run ${i}, -l FILE: ${rate} req/s"
+  [ ${rate} -gt ${best_file} ] && best_file=${rate}
+  rate=$(run -x '*' -i BENCH_ME -l -)
+  echo "Run ${i}, -l -: ${rate} req/s"
+  [ ${rate} -gt ${best_stdout} ] && best_stdout=${rate}
+done
+
+# Overhead in tenths of a percent, relative to no access log
+overhead() { echo $(((best_none - $1) * 1000 / best_none)); }
+file=$(overhead ${best_file})
+stdout=$(overhead ${best_stdout})
+echo "Best of ${RUNS} runs of ${REQUESTS} requests:"
+echo "  no access log: ${best_none} req/s"
+echo "  -l FILE:       ${best_file} req/s, $((file / 10)).$((file < 0 ? -file % 10 : file % 10))% slower"
+echo "  -l -:          ${best_stdout} req/s, $((stdout / 10)).$((stdout < 0 ? -stdout % 10 : stdout % 10))% slower"
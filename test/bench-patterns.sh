@@ -0,0 +1,46 @@
+#!/bin/sh
+
+# Startup time with 10000 env vars filtered by 500 -i/-x patterns, a mix of
+# exact names, NAME* prefixes and other globs. Run from the repo root:
+#
+#   sh test/bench-patterns.sh [path/to/envhttpd] [runs]
+
+set -e -u -f
+
+BIN="${1:-bin/envhttpd}"
+RUNS="${2:-5}"
+PORT="${BENCH_PORT:-8123}"
+KEYS=10000
+
+DIR=$(mktemp -d)
+trap 'rm -rf "${DIR}"' EXIT
+
+awk -v n=${KEYS} 'BEGIN { for (i = 0; i < n; i++) printf "SVC%d_KEY%d=value%d\n", i % 100, i, i }' \
+  >"${DIR}/env"
+
+# Exclude everything, then include 200 names and 200 prefixes and exclude
+# 99 globs, so later patterns keep overriding earlier ones
+awk 'BEGIN {
+  print "-x"; print "*"
+  for (i = 0; i < 200; i++) { print "-i"; printf "SVC%d_KEY%d\n", (i * 37) % 100, (i * 37) % 100 + 100 * i }
+  for (i = 100; i < 300; i++) { print "-i"; printf "SVC%d_KEY%d*\n", i % 100, i }
+  for (i = 0; i < 99; i++) { print "-x"; printf "*_KEY%d?[13579]\n", i }
+}' >"${DIR}/patterns"
+
+now_us() { echo $(($(date +%s%N) / 1000)); }
+
+total=0
+for run in $(seq 1 ${RUNS}); do
+  start=$(now_us)
+  # One argument per line, word split with globbing off (set -f)
+  "${BIN}" -p ${PORT} -f "${DIR}/env" $(cat "${DIR}/patterns") >/dev/null &
+  pid=$!
+  until curl -s -o "${DIR}/env.json" "http://localhost:${PORT}/json"; do :; done
+  elapsed=$(($(now_us) - start))
+  kill ${pid}
+  wait ${pid} || true
+  vars=$(grep -o '"SVC' "${DIR}/env.json" | wc -l)
+  echo "Run ${run}: ${elapsed} us to first response, ${vars} of ${KEYS} vars included"
+  total=$((total + elapsed))
+done
+echo "Mean: $((total / RUNS)) us over ${RUNS} runs, $(($(wc -l <"${DIR}/patterns") / 2)) patterns"
@@ -0,0 +1,127 @@
+// An HTTP/2 client that fetches a path and leaves the server's default
+// 64 KiB flow control window shut for a while once it is used up, so the
+// rest of the response is still held back by the server meanwhile. Prints
+// how many body bytes arrived and whether the stream ended. Built and run
+// by test/test-upgrade.sh.
+//
+//   h2-slow-client PORT PATH PAUSE_MS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+static int write_all(int fd, const void *data, size_t len) {
+  const char *p = data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0) { return -1; }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_all(int fd, unsigned char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n <= 0) { return -1; }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void frame_header(unsigned char *h, size_t len, int type, int flags, unsigned int id) {
+  h[0] = len >> 16;
+  h[1] = len >> 8;
+  h[2] = len;
+  h[3] = type;
+  h[4] = flags;
+  h[5] = id >> 24;
+  h[6] = id >> 16;
+  h[7] = id >> 8;
+  h[8] = id;
+}
+
+static int window_update(int fd, unsigned int id, unsigned int increment) {
+  unsigned char frame[13];
+  frame_header(frame, 4, 8, 0, id);
+  frame[9] = increment >> 24;
+  frame[10] = increment >> 16;
+  frame[11] = increment >> 8;
+  frame[12] = increment;
+  return write_all(fd, frame, sizeof(frame));
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s PORT PATH PAUSE_MS\n", argv[0]);
+    return 2;
+  }
+  const char *path = argv[2];
+  size_t path_len = strlen(path);
+  int pause_ms = atoi(argv[3]);
+  signal(SIGPIPE, SIG_IGN); // The server may have gone, which is reported
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(atoi(argv[1])) };
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || path_len > 127) {
+    perror("connect failed");
+    return 2;
+  }
+
+  // Preface, empty SETTINGS, then GET PATH on stream 1: :method GET and
+  // :scheme http from the static table, :path as a literal
+  unsigned char out[256];
+  size_t n = 0;
+  memcpy(out, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+  n += 24;
+  frame_header(out + n, 0, 4, 0, 0);
+  n += 9;
+  size_t block_len = 2 + 2 + path_len;
+  frame_header(out + n, block_len, 1, 0x05, 1);
+  n += 9;
+  out[n++] = 0x82;
+  out[n++] = 0x86;
+  out[n++] = 0x04;
+  out[n++] = path_len;
+  memcpy(out + n, path, path_len);
+  n += path_len;
+  if (write_all(fd, out, n) < 0) {
+    perror("write failed");
+    return 2;
+  }
+
+  size_t received = 0;
+  int ended = 0;
+  int paused = 0;
+  unsigned char h[9];
+  unsigned char payload[1 << 14];
+  while (!ended && read_all(fd, h, 9) == 0) {
+    size_t len = (size_t)h[0] << 16 | h[1] << 8 | h[2];
+    unsigned int id = ((unsigned int)h[5] << 24 | h[6] << 16 | h[7] << 8 | h[8]) & 0x7fffffff;
+    if (len > sizeof(payload) || read_all(fd, payload, len) < 0) { break; }
+    if (h[3] == 4 && !(h[4] & 0x01)) {
+      unsigned char ack[9];
+      frame_header(ack, 0, 4, 0x01, 0);
+      write_all(fd, ack, sizeof(ack));
+    }
+    if (id != 1 || (h[3] != 0 && h[3] != 1)) { continue; }
+    if (h[3] == 0) { received += len; }
+    ended = h[4] & 0x01;
+    if (!paused && received >= 65535) {
+      paused = 1;
+      struct timespec pause = { pause_ms / 1000, (pause_ms % 1000) * 1000000L };
+      nanosleep(&pause, NULL);
+      window_update(fd, 0, 0x7f000000);
+      window_update(fd, 1, 0x7f000000);
+    }
+  }
+  printf("%zu bytes, %s\n", received, ended ? "complete" : "cut off");
+  close(fd);
+  return ended ? 0 : 1;
+}
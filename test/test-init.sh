@@ -1,6 +1,8 @@
 #!/bin/sh
 # Test that envhttpd exits cleanly when run as PID 1 (init) and receives SIGTERM.
 # docker stop sends SIGTERM to PID 1; we expect exit code 0 from our handler.
+# Before that, upgrade with SIGUSR2 twice: PID 1 must stay up as init for the
+# new process and pass SIGUSR2 and SIGTERM on to it.
 set -e -u
 
 IMAGE="${IMAGE:-kilna/envhttpd}"
@@ -15,6 +17,33 @@ docker run -d --name "$CONTAINER" "${IMAGE}:${TAG}" -x '*' -D
 
 sleep 1
 
+echo "Sending SIGUSR2 for a zero-downtime upgrade..."
+docker kill -s USR2 "$CONTAINER"
+sleep 1
+if docker logs "$CONTAINER" 2>&1 | grep -q "Upgrade complete"; then
+  echo "OK: envhttpd handed over to a new process"
+else
+  echo "Error: upgrade did not complete"
+  docker logs "$CONTAINER"
+  exit 1
+fi
+if [ "$(docker inspect "$CONTAINER" --format '{{.State.Running}}')" != "true" ]; then
+  echo "Error: container stopped after upgrade"
+  exit 1
+fi
+
+echo "Sending SIGUSR2 again, which PID 1 must pass on to the new process..."
+docker kill -s USR2 "$CONTAINER"
+sleep 1
+upgrades=$(docker logs "$CONTAINER" 2>&1 | grep -c "Upgrade complete" || true)
+if [ "$upgrades" = "2" ]; then
+  echo "OK: second upgrade was forwarded and completed"
+else
+  echo "Error: expected 2 completed upgrades, got $upgrades"
+  docker logs "$CONTAINER"
+  exit 1
+fi
+
 echo "Sending SIGTERM via docker stop (timeout 3s)..."
 docker stop -t 3 "$CONTAINER"
 
@@ -0,0 +1,119 @@
+// Checks the compiled include/exclude matcher against a plain in-order
+// fnmatch() loop, on fixed cases and on random patterns. Built and run by
+// test/test-patterns.sh.
+#define main envhttpd_main
+#include "../src/envhttpd.c"
+#undef main
+
+// What include_var() has to agree with: the last matching pattern wins,
+// otherwise everything but PATH and HOME is shown
+static int reference_include(const char *key) {
+  int include = strcmp(key, "PATH") != 0 && strcmp(key, "HOME") != 0;
+  for (int i = 0; i < pattern_action_count; i++) {
+    if (fnmatch(pattern_actions[i].pattern, key, 0) == 0) {
+      include = pattern_actions[i].type == PATTERN_INCLUDE;
+    }
+  }
+  return include;
+}
+
+// Forgets the previous patterns, the old allocations are left to leak
+static void reset_patterns() {
+  pattern_action_count = 0;
+  literal_patterns = (NameTable){0};
+  prefix_trie_count = 0;
+  glob_pattern_count = 0;
+  decision_cache = (NameTable){0};
+}
+
+// Patterns as "-i PATTERN" / "-x PATTERN" words, keys space separated
+static int check(const char **patterns, int pattern_count, const char **keys, int key_count) {
+  reset_patterns();
+  for (int i = 0; i + 1 < pattern_count; i += 2) {
+    add_patterns((char *)patterns[i + 1],
+                 strcmp(patterns[i], "-i") == 0 ? PATTERN_INCLUDE : PATTERN_EXCLUDE);
+  }
+  compile_patterns();
+  int failed = 0;
+  // Twice, so the second pass comes from the decision cache
+  for (int pass = 0; pass < 2; pass++) {
+    for (int k = 0; k < key_count; k++) {
+      int got = include_var(keys[k]);
+      int want = reference_include(keys[k]);
+      if (got != want) {
+        printf("Error: %s %s, expected %s, patterns:", keys[k],
+               got ? "included" : "excluded", want ? "included" : "excluded");
+        for (int i = 0; i < pattern_count; i++) { printf(" '%s'", patterns[i]); }
+        printf("\n");
+        failed++;
+      }
+    }
+  }
+  return failed;
+}
+
+#define CHECK(keys, ...) do { \
+    const char *patterns[] = { __VA_ARGS__ }; \
+    errors += check(patterns, sizeof(patterns) / sizeof(*patterns), keys, sizeof(keys) / sizeof(*keys)); \
+    cases++; \
+  } while (0)
+
+static const char *keys[] = {
+  "PATH", "HOME", "HOSTNAME", "A", "AX", "BX", "aX", "xX", "]X", "X",
+  "APP_A", "APP_B", "APP_DB_SECRET", "APP_", "APP", "app_db_secret",
+  "FOO", "FOO1", "FOO12", "FOOx", "FOO*", "FOO?", "FOO[", "F\\O", "*", "?",
+};
+
+static const char *random_pattern(char *buf) {
+  static const char *pieces[] = {
+    "A", "X", "APP", "_", "FOO", "1", "*", "?", "[A-Z]", "[a-z]", "[!X]",
+    "[^1]", "[]X]", "[!]X]", "[[:upper:]]", "[[:lower:]]", "[[:digit:]]",
+    "[[:alpha:]_]", "\\*", "\\A", "[", "]", "PATH", "HOME",
+  };
+  buf[0] = '\0';
+  int n = rand() % 4 + 1;
+  for (int i = 0; i < n; i++) { strcat(buf, pieces[rand() % (sizeof(pieces) / sizeof(*pieces))]); }
+  return buf;
+}
+
+int main() {
+  int errors = 0;
+  int cases = 0;
+
+  CHECK(keys, "-x", "*");
+  CHECK(keys, "-i", "*");
+  CHECK(keys, "-i", "PATH");
+  CHECK(keys, "-x", "FOO", "-i", "HOME");
+  CHECK(keys, "-x", "*", "-i", "APP_*", "-x", "APP_*_SECRET");
+  CHECK(keys, "-x", "*", "-i", "APP_*", "-x", "APP_DB_SECRET", "-i", "APP_*");
+  CHECK(keys, "-x", "*", "-i", "FOO?");
+  CHECK(keys, "-x", "*", "-i", "[A-Z]X");
+  CHECK(keys, "-x", "*", "-i", "[a-z]X");
+  CHECK(keys, "-x", "*", "-i", "[!x]X");
+  CHECK(keys, "-x", "*", "-i", "[]x]X");
+  CHECK(keys, "-x", "*", "-i", "[!]x]X");
+  CHECK(keys, "-x", "*", "-i", "[[:upper:]]X");
+  CHECK(keys, "-i", "*", "-x", "[[:lower:]]*_secret");
+  CHECK(keys, "-x", "*", "-i", "[[:alpha:]]*", "-x", "*[[:digit:]]");
+  CHECK(keys, "-x", "*", "-i", "FOO\\*", "-i", "\\?");
+  CHECK(keys, "-x", "*", "-i", "F\\\\O", "-i", "\\A");
+  CHECK(keys, "-x", "*", "-i", "FOO[");
+  CHECK(keys, "-i", "FOO*", "-x", "FOO1*", "-i", "FOO12");
+  CHECK(keys, "-x", "A*", "-i", "AX", "-x", "*X");
+
+  srand(1);
+  for (int seed = 0; seed < 2000; seed++) {
+    char bufs[16][128];
+    const char *patterns[32];
+    int count = 2 * (rand() % 16);
+    for (int i = 0; i < count; i += 2) {
+      patterns[i] = rand() % 2 ? "-i" : "-x";
+      patterns[i + 1] = random_pattern(bufs[i / 2]);
+    }
+    errors += check(patterns, count, keys, sizeof(keys) / sizeof(*keys));
+    cases++;
+  }
+
+  printf("%d pattern sets checked, %d mismatches\n", cases, errors);
+  return errors ? 1 : 0;
+}
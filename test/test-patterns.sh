@@ -0,0 +1,16 @@
+#!/bin/sh
+
+# Compares the compiled -i/-x matcher with a plain in-order fnmatch() loop.
+# Run from the repo root:
+#
+#   sh test/test-patterns.sh
+
+set -e -u
+
+make -f src/Makefile src/template.h src/icon.h src/routes.h >/dev/null
+
+DIR=$(mktemp -d)
+trap 'rm -rf "${DIR}"' EXIT
+
+gcc -O2 -pthread -w test/test-patterns.c -o "${DIR}/test-patterns"
+"${DIR}/test-patterns"
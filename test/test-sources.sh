@@ -0,0 +1,167 @@
+#!/bin/sh
+
+# Env sources against a local server: another process's environ, env files,
+# -u refreshes and SIGHUP reloads. Run from the repo root:
+#
+#   sh test/test-sources.sh [path/to/envhttpd]
+
+set -e -u
+
+BIN=$(cd "$(dirname "${1:-bin/envhttpd}")" && pwd)/$(basename "${1:-bin/envhttpd}")
+PORT="${SOURCES_PORT:-8124}"
+BASE_URL="http://localhost:${PORT}"
+
+DIR=$(mktemp -d)
+SERVER=
+HELPER=
+cleanup() {
+  [ -n "${SERVER}" ] && kill ${SERVER} 2>/dev/null || true
+  [ -n "${HELPER}" ] && kill ${HELPER} 2>/dev/null || true
+  rm -rf "${DIR}"
+}
+trap cleanup EXIT
+cd "${DIR}"
+
+ERROR=0
+
+assert_present() {
+  if grep -qF "$2" "$1"; then echo "OK: $2 found in $1"; return 0; fi
+  echo "Error: $2 not found in $1"; ERROR=$((ERROR + 1)); return 1
+}
+
+assert_missing() {
+  if ! grep -qF "$2" "$1"; then echo "OK: $2 not found in $1"; return 0; fi
+  echo "NOT OK: $2 found in $1"; ERROR=$((ERROR + 1)); return 1
+}
+
+start_server() {
+  env -i SERVER_ONLY=yes "${BIN}" -p ${PORT} "$@" >server.log 2>&1 &
+  SERVER=$!
+  tries=0
+  until curl -s -o /dev/null "${BASE_URL}/sys"; do
+    tries=$((tries + 1))
+    if [ ${tries} -gt 100 ]; then echo "Error: server did not start"; cat server.log; exit 1; fi
+    sleep 0.05
+  done
+}
+
+stop_server() {
+  kill ${SERVER}
+  wait ${SERVER} || true
+  SERVER=
+}
+
+save() {
+  echo "Saving ${BASE_URL}$1 to $2"
+  curl -s -D "$2.headers" -o "$2" "${BASE_URL}$1"
+}
+
+# Another process's environment, with -x still applied
+env -i SRC_NAME=alpha SRC_SECRET=hidden sleep 60 &
+HELPER=$!
+# Its environ only changes once env has exec'd sleep
+until grep -q sleep /proc/${HELPER}/comm; do sleep 0.01; done
+start_server -s proc:${HELPER} -x '*_SECRET'
+save /json proc.json
+stop_server
+kill ${HELPER}
+HELPER=
+
+assert_present proc.json '"SRC_NAME":"alpha"'
+assert_missing proc.json "SRC_SECRET"
+assert_missing proc.json "SERVER_ONLY"
+
+# An env file in docker's format
+printf '%s\n' \
+  'PLAIN=one' \
+  'DOUBLE="two words"' \
+  "SINGLE='three'" \
+  '# COMMENTED=out' \
+  '' \
+  "MIXED=\"four'" >app.env
+printf 'CRLF=five\r\n' >>app.env
+start_server -s file:app.env
+save /var/PLAIN plain.txt
+save /var/DOUBLE double.txt
+save /var/SINGLE single.txt
+save /var/MIXED mixed.txt
+save /var/CRLF crlf.txt
+save /var/COMMENTED commented.txt
+save /json file.json
+stop_server
+
+assert_present plain.txt "one"
+assert_present double.txt "two words"
+assert_missing double.txt '"'
+assert_present single.txt "three"
+assert_missing single.txt "'"
+assert_present mixed.txt "\"four'"
+assert_present crlf.txt "five"
+assert_missing crlf.txt "$(printf '\r')"
+assert_present commented.txt.headers "404 Not Found"
+assert_missing file.json "SERVER_ONLY"
+
+# -u re-reads the file, but only parses and bumps the version on a change
+echo "KEY=before" >refresh.env
+start_server -s file:refresh.env -u 1
+save /json refresh1.json
+sleep 1.5
+save /metrics refresh_unchanged.txt
+save /json refresh2.json
+echo "KEY=after" >refresh.env
+sleep 1.5
+save /metrics refresh_changed.txt
+save /json refresh3.json
+stop_server
+
+assert_present refresh1.json.headers "Env-Version: 1"
+assert_present refresh_unchanged.txt 'envhttpd_env_source_reads_total{outcome="parsed"} 1'
+assert_missing refresh_unchanged.txt 'envhttpd_env_source_reads_total{outcome="unchanged"} 0'
+assert_present refresh2.json.headers "Env-Version: 1"
+assert_present refresh2.json '"KEY":"before"'
+assert_present refresh_changed.txt 'envhttpd_env_source_reads_total{outcome="parsed"} 2'
+assert_present refresh3.json.headers "Env-Version: 2"
+assert_present refresh3.json '"KEY":"after"'
+
+# SIGHUP reloads the file, waking a parked long-poll and /events
+printf 'KEEP=same\nCHANGE=old\nDROP=gone\n' >reload.env
+start_server -f reload.env
+echo "Waiting on ${BASE_URL}/json?wait=1 and ${BASE_URL}/events"
+curl -s -m 10 -D wait.json.headers -o wait.json "${BASE_URL}/json?wait=1&timeout=10" &
+WAITER=$!
+curl -s -N -m 2 -o events.txt "${BASE_URL}/events" &
+EVENTS=$!
+sleep 0.5
+printf 'KEEP=same\nCHANGE=new\nADD=fresh\n' >reload.env
+kill -HUP ${SERVER}
+wait ${WAITER} || true
+wait ${EVENTS} || true
+stop_server
+
+assert_present wait.json.headers "200 OK"
+assert_present wait.json.headers "Env-Version: 2"
+assert_present wait.json '"CHANGE":"new"'
+assert_present wait.json '"ADD":"fresh"'
+assert_missing wait.json "DROP"
+assert_present events.txt 'data: {"version":1}'
+assert_present events.txt "event: change"
+assert_present events.txt 'data: {"version":2,"changed":["CHANGE","ADD"],"removed":["DROP"]}'
+
+# A reload while a request is on its way must not cost that request, which
+# is answered before or after the reload
+echo "KEY=before" >reload.env
+start_server -f reload.env
+echo "Sending SIGHUP while a request is on its way"
+(sleep 1; printf 'GET /json HTTP/1.1\r\nHost: localhost\r\n\r\n'; sleep 1) \
+  | curl -s -m 5 -o hup.txt "telnet://localhost:${PORT}" &
+CLIENT=$!
+sleep 0.5
+echo "KEY=after" >reload.env
+kill -HUP ${SERVER}
+wait ${CLIENT} || true
+stop_server
+
+assert_present hup.txt "200 OK"
+assert_present hup.txt '"KEY":'
+
+exit ${ERROR}
@@ -0,0 +1,93 @@
+#!/bin/sh
+
+# Zero-downtime upgrades against a local server: a SIGUSR2 handover must not
+# drop a request that is still arriving, nor cut off an HTTP/2 response that
+# is still going out. Run from the repo root:
+#
+#   sh test/test-upgrade.sh [path/to/envhttpd]
+
+set -e -u
+
+BIN=$(cd "$(dirname "${1:-bin/envhttpd}")" && pwd)/$(basename "${1:-bin/envhttpd}")
+ROOT=$(pwd)
+PORT="${UPGRADE_PORT:-8125}"
+BASE_URL="http://localhost:${PORT}"
+
+DIR=$(mktemp -d)
+SERVER=
+cleanup() {
+  [ -n "${SERVER}" ] && kill ${SERVER} 2>/dev/null || true
+  rm -rf "${DIR}"
+}
+trap cleanup EXIT
+cd "${DIR}"
+
+ERROR=0
+
+assert_present() {
+  if grep -qF "$2" "$1"; then echo "OK: $2 found in $1"; return 0; fi
+  echo "Error: $2 not found in $1"; ERROR=$((ERROR + 1)); return 1
+}
+
+start_server() {
+  env -i UPGRADE_ME=yes "${BIN}" -p ${PORT} "$@" >server.log 2>&1 &
+  SERVER=$!
+  tries=0
+  until curl -s -o /dev/null "${BASE_URL}/sys"; do
+    tries=$((tries + 1))
+    if [ ${tries} -gt 100 ]; then echo "Error: server did not start"; cat server.log; exit 1; fi
+    sleep 0.05
+  done
+}
+
+# Connects and sends the request a second later, so the server is waiting
+# to read it when $1 is sent
+slow_request() {
+  (sleep 1; printf 'GET /json HTTP/1.1\r\nHost: localhost\r\n\r\n'; sleep 1) \
+    | curl -s -m 5 -o "$2" "telnet://localhost:${PORT}" &
+  CLIENT=$!
+  sleep 0.5
+  kill -$1 ${SERVER}
+  wait ${CLIENT} || true
+}
+
+start_server -x '*' -i UPGRADE_ME
+echo "Sending SIGUSR2 while a request is on its way"
+slow_request USR2 usr2.txt
+tries=0
+until grep -q "Upgrade complete" server.log; do
+  tries=$((tries + 1))
+  if [ ${tries} -gt 100 ]; then break; fi
+  sleep 0.05
+done
+assert_present usr2.txt "200 OK"
+assert_present usr2.txt '"UPGRADE_ME":"yes"'
+assert_present server.log "Upgrade complete"
+curl -s -o after.json "${BASE_URL}/json"
+assert_present after.json '"UPGRADE_ME":"yes"'
+
+# The new server was started by the old one, which has exited
+wait ${SERVER} || true
+SERVER=$(sed -n 's/^Upgrading: started pid //p' server.log)
+kill ${SERVER}
+wait_gone() { while kill -0 $1 2>/dev/null; do sleep 0.05; done; }
+wait_gone ${SERVER}
+
+# An HTTP/2 response held back by flow control over the handover is still
+# finished by the old server
+gcc -O2 "${ROOT}/test/h2-slow-client.c" -o h2-slow-client
+awk 'BEGIN { for (i = 0; i < 300; i++) { printf "BIG%d=", i; for (j = 0; j < 1000; j++) printf "x"; print "" } }' >big.env
+start_server -f big.env
+curl -s -o big.json "${BASE_URL}/json"
+echo "Sending SIGUSR2 while an HTTP/2 response waits for its window"
+./h2-slow-client ${PORT} /json 1500 >h2_drain.txt &
+CLIENT=$!
+sleep 0.5
+kill -USR2 ${SERVER}
+wait ${CLIENT} || true
+assert_present h2_drain.txt "$(wc -c <big.json | tr -d ' ') bytes, complete"
+wait ${SERVER} || true
+SERVER=$(sed -n 's/^Upgrading: started pid //p' server.log)
+kill ${SERVER}
+
+exit ${ERROR}
@@ -28,7 +28,15 @@ for path_file in \
   "/yaml env.yaml" \
   "/sh env.sh" \
   "/sh?export export.sh" \
+  "/json?pretty=1 pretty1.json" \
+  "/sh?export&x=1 export1.sh" \
+  "/var/INCLUDE%5FME var_encoded.txt" \
+  "/json?wait=0 wait_ready.json" \
+  "/json?wait=1&timeout=1 wait_timeout.json" \
+  "/sys sys_limited.txt" \
+  "/metrics metrics.txt" \
   "/404 404.txt" \
+  "/debug/profile debug_profile.txt" \
   "/var/EXCLUDE_ME var_EXCLUDE_ME.txt"
 do
   path=$(echo ${path_file} | cut -d' ' -f1)
@@ -38,6 +46,31 @@ do
   #cat ${file}.headers ${file}
 done
 
+echo "Saving HEAD ${BASE_URL}/json to head.json"
+curl -s -I -o head.json ${BASE_URL}/json
+
+# Raw, since curl -I would hide a body sent after the headers
+echo "Saving HEAD ${BASE_URL}/404 to head404.txt"
+printf 'HEAD /404 HTTP/1.1\r\nHost: %s\r\n\r\n' "${SERVER_HOST}" \
+  | curl -s -m 2 -o head404.txt "telnet://${SERVER_HOST}:${SERVER_PORT}" || true
+
+echo "Saving ${BASE_URL}/json over HTTP/2 to h2.json and h2c.json"
+curl -s --http2-prior-knowledge -D h2.json.headers -o h2.json ${BASE_URL}/json
+curl -s --http2 -D h2c.json.headers -o h2c.json ${BASE_URL}/json
+curl -s --http2-prior-knowledge -I -o h2_head404.txt ${BASE_URL}/404 \
+  || echo "curl failed with $?" >>h2_head404.txt
+
+echo "Saving ${BASE_URL}/events to events.txt"
+curl -s -N -m 1 -o events.txt ${BASE_URL}/events || true
+
+# A client that connects and sends nothing mustn't hold up anyone else, and
+# gets a 408 once its request is overdue
+echo "Saving ${BASE_URL}/json to idle_other.json while another client idles"
+sleep 7 | curl -s -m 8 -o idle.txt "telnet://${SERVER_HOST}:${SERVER_PORT}" &
+IDLE=$!
+sleep 0.5
+curl -s -m 2 -D idle_other.json.headers -o idle_other.json ${BASE_URL}/json || true
+wait ${IDLE} || true
 
 echo "================================================"
 echo "BASE_URL: ${BASE_URL}"
@@ -104,9 +137,65 @@ assert_present export.sh "yes"
 assert_missing export.sh "HOSTNAME"
 assert_missing export.sh "EXCLUDE_ME"
 
+assert_present pretty1.json.headers "200 OK"
+assert_present pretty1.json '  "INCLUDE_ME": "yes"'
+
+assert_present export1.sh.headers "200 OK"
+assert_present export1.sh 'export INCLUDE_ME="yes"'
+
+assert_present var_encoded.txt.headers "200 OK"
+assert_present var_encoded.txt "yes"
+
+assert_present head.json "200 OK"
+assert_present head.json "Content-Length: $(wc -c < compact.json | tr -d ' ')"
+assert_missing head.json "INCLUDE_ME"
+
+assert_present compact.json.headers "Env-Version: 1"
+
+assert_present wait_ready.json.headers "200 OK"
+assert_present wait_ready.json "INCLUDE_ME"
+
+assert_present wait_timeout.json.headers "304 Not Modified"
+assert_present wait_timeout.json.headers "Env-Version: 1"
+
+assert_present h2.json.headers "HTTP/2 200"
+assert_present h2.json '"INCLUDE_ME":"yes"'
+assert_present h2c.json.headers "101 Switching Protocols"
+assert_present h2c.json.headers "HTTP/2 200"
+assert_present h2c.json '"INCLUDE_ME":"yes"'
+assert_present h2_head404.txt "HTTP/2 404"
+assert_missing h2_head404.txt "curl failed"
+
+assert_present events.txt "event: version"
+assert_present events.txt 'data: {"version":1}'
+
+assert_present idle_other.json.headers "200 OK"
+assert_present idle_other.json '"INCLUDE_ME":"yes"'
+assert_present idle.txt "408 Request Timeout"
+
+assert_present sys_limited.txt.headers "429 Too Many Requests"
+assert_present sys_limited.txt.headers "Retry-After:"
+
+assert_present metrics.txt.headers "200 OK"
+assert_present metrics.txt 'envhttpd_limiter_requests_total{route="/sys",decision="allowed"} 1'
+assert_present metrics.txt 'envhttpd_limiter_requests_total{route="/sys",decision="limited"} 1'
+assert_present metrics.txt 'envhttpd_env_source_reads_total{outcome="failed"} 0'
+assert_present metrics.txt 'envhttpd_access_log_records_total{outcome="dropped"} 0'
+
 assert_present 404.txt.headers "404 Not Found"
 assert_present 404.txt "Not Found"
 
+assert_present head404.txt "404 Not Found"
+assert_present head404.txt "Content-Length: 10"
+if [ -z "$(sed '1,/^\r$/d' head404.txt)" ]; then
+  echo "OK: HEAD 404 has no body"
+else
+  echo "Error: HEAD 404 sent a body"; ERROR=$((ERROR + 1))
+fi
+
+# The profiler is off unless built with PROFILE=1 and started with -P
+assert_present debug_profile.txt.headers "404 Not Found"
+
 assert_present var_EXCLUDE_ME.txt.headers "404 Not Found"
 assert_present var_EXCLUDE_ME.txt "Not Found"
 